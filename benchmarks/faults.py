@@ -0,0 +1,64 @@
+#!/usr/bin/env python
+"""Throughput and tail latency of transfer() under set_faults() profiles.
+
+Runs on the mock backend, so no hardware is needed:
+
+    $ python benchmarks/faults.py [calls]
+
+Failed transfers count towards the latency figures but not towards
+transfers/s.
+"""
+import sys
+import time
+
+import spipy
+
+CALLS = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+SEED = 1
+
+PROFILES = (
+    ("none", {}),
+    ("errors", {"error_rate": 0.01}),
+    ("bit flips", {"flip_rate": 0.001}),
+    ("latency", {"latency_usec": 500, "latency_rate": 0.01}),
+    ("busy", {"busy_rate": 0.01, "busy_messages": 4}),
+)
+
+
+def percentile(ordered, p):
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p))]
+
+
+def run(spi, values):
+    latencies = []
+    ok = 0
+    start = time.time()
+    for i in xrange(CALLS):
+        t = time.time()
+        try:
+            spi.transfer(values)
+            ok += 1
+        except IOError:
+            pass
+        latencies.append(time.time() - t)
+    elapsed = time.time() - start
+    latencies.sort()
+    return (ok / elapsed, percentile(latencies, 0.50) * 1e6,
+            percentile(latencies, 0.99) * 1e6)
+
+
+def main():
+    spi = spipy.SPI(0, 0, mock=True)
+    values = tuple(i & 0xff for i in range(32))
+    print "%10s %12s %10s %10s" % ("profile", "transfers/s", "p50 us",
+            "p99 us")
+    for name, faults in PROFILES:
+        spi.set_faults(seed=SEED, **faults)
+        rate, p50, p99 = run(spi, values)
+        print "%10s %12.0f %10.2f %10.2f" % (name, rate, p50, p99)
+    spi.set_faults()
+    spi.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,35 @@
+#!/usr/bin/env python
+"""Compare transfer() returning tuples with the result ring.
+
+Runs on the mock backend, so no hardware is needed:
+
+    $ python benchmarks/result_ring.py [calls]
+"""
+import sys
+import timeit
+
+import spipy
+
+CALLS = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+
+
+def per_call(spi, values):
+    t = timeit.Timer(lambda: spi.transfer(values))
+    return min(t.repeat(3, CALLS)) / CALLS * 1e6
+
+
+def main():
+    spi = spipy.SPI(0, 0, mock=True)
+    print "%8s %12s %12s" % ("bytes", "tuple us", "ring us")
+    for size in (3, 32, 128, 256):
+        values = tuple(i & 0xff for i in range(size))
+        spi.set_result_ring(0)
+        tuples = per_call(spi, values)
+        spi.set_result_ring(4)
+        ring = per_call(spi, values)
+        print "%8d %12.2f %12.2f" % (size, tuples, ring)
+    spi.close()
+
+
+if __name__ == "__main__":
+    main()
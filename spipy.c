@@ -1,371 +1,6962 @@
-/*
- * spipy.c - Python bindings for Linux SPI access through spidev
- * Copyright (C) 2009 Volker Thoms <unconnected@gmx.de>
- * Copyright (C) 2013 Thomas Preston <thomasmarkpreston@gmail.com>
- *
- * This program is free software; you can redistribute it and/or modify
- * it under the terms of the GNU General Public License as published by
- * the Free Software Foundation; version 2 of the License.
- *
- * This program is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
- * GNU General Public License for more details.
- *
- * You should have received a copy of the GNU General Public License
- * along with this program; if not, write to the Free Software
- * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
- */
-
-#include <Python.h>
-#include "structmember.h"
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-#include <fcntl.h>
-#include <linux/spi/spidev.h>
-#include <linux/types.h>
-#include <sys/ioctl.h>
-
-//#define VERBOSE_MODE // comment out to turn off debugging
-
-#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
-#define MAXPATH 16
-#define MAX_TRANSFER_LENGTH 256
-
-PyDoc_STRVAR(SPI_module_doc,
-        "This module defines an object type that allows SPI transactions\n"
-        "on hosts running the Linux kernel. The host kernel must have SPI\n"
-        "support and SPI device interface support.\n"
-        "All of these can be either built-in to the kernel, or loaded from\n"
-        "modules.\n"
-        "\n"
-        "Because the SPI device interface is opened R/W, users of this\n"
-        "module usually must have root permissions.\n");
-
-typedef struct
-{
-    PyObject_HEAD
-
-    int fd;         /* open file descriptor: /dev/spi-X.Y */
-    uint8_t mode;     /* current SPI mode */
-    uint8_t bpw;     /* current SPI bits per word setting */
-    uint32_t msh;     /* current SPI max speed setting in Hz */
-} SPI;
-
-static PyObject * SpiError; // special exception
-
-static PyObject *
-SPI_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
-{
-    SPI *self;
-    if ((self = (SPI *) type->tp_alloc(type, 0)) == NULL)
-        return NULL;
-
-    self->fd = -1;
-    self->mode = 0;
-    self->bpw = 0;
-    self->msh = 0;
-
-    Py_INCREF(self);
-    return (PyObject *) self;
-}
-
-PyDoc_STRVAR(SPI_close_doc,
-        "close()\n\n"
-        "Disconnects the object from the interface.\n");
-
-static PyObject *SPI_close(SPI *self)
-{
-    if ((self->fd != -1) && (close(self->fd) == -1))
-    {
-        PyErr_SetFromErrno(PyExc_IOError);
-        return NULL;
-    }
-
-    self->fd = -1;
-    self->mode = 0;
-    self->bpw = 0;
-    self->msh = 0;
-
-    Py_INCREF(Py_None);
-    return Py_None;
-}
-
-PyDoc_STRVAR(SPI_transfer_doc,
-        "transfer([values]) -> [values]\n\n"
-        "Perform SPI transaction.\n"
-        "CS will be released and reactivated between blocks.\n"
-        "delay specifies delay in usec between blocks.\n");
-
-static PyObject* SPI_transfer(SPI *self, PyObject *args)
-{
-    PyObject* obj;
-    PyObject* seq;
-
-    int ret;
-    uint8_t bits = 8;
-    uint16_t delay = 5;
-    uint32_t speed = 1000000;
-    int i = 0;
-
-    long tx_char;
-    unsigned char tx_buf[MAX_TRANSFER_LENGTH];
-    unsigned char rx_buf[MAX_TRANSFER_LENGTH];
-    int tx_length;
-    int rx_length = 0;
-    int transfer_length;
-
-    if (!PyArg_ParseTuple(args, "O|i:transfer", &obj, &rx_length))
-        return NULL;
-
-    seq = PySequence_Fast(obj, "Expected a sequence type");
-    tx_length = PySequence_Size(obj);
-    for (i = 0; i < tx_length; i++)
-    {
-        tx_char = PyInt_AsLong(PySequence_Fast_GET_ITEM(seq, i));
-        if(tx_char > 255 || tx_char < 0)
-        {
-            PyErr_SetString(PyExc_AttributeError, "Transmit data should be valid 8-bit data");
-            return NULL;
-        }
-        tx_buf[i] = (unsigned char)tx_char;
-    }
-    Py_DECREF(seq);
-    Py_DECREF(obj);
-
-#ifdef VERBOSE_MODE
-    printf ("Length of String List from Python: %d\n", tx_length);
-#endif
-
-    if (tx_length > rx_length)
-    {
-        transfer_length = tx_length;
-    }
-    else
-    {
-        transfer_length = rx_length;
-    }
-
-    i = tx_length;
-    while (i < transfer_length)
-    {
-        tx_buf[i] = 0;
-        i++;
-    }
-
-#ifdef VERBOSE_MODE
-//printf("TX array size after conversion: %d\n",ARRAY_SIZE(tx));
-
-    printf("Data for SPI to Transmit!!  TX:  ");
-    for (i = 0; i < transfer_length; i++)
-    {
-        printf("%.2X ", tx_buf[i]);
-    }
-    puts(""); // newline
-#endif
-
-    /*This is the transfer part, and sets up
-     the details needed to transfer the data*/
-    struct spi_ioc_transfer transfer =
-    {
-        .tx_buf = (unsigned long) tx_buf,
-        .rx_buf = (unsigned long) rx_buf,
-        .len = transfer_length,
-        .delay_usecs = delay,
-        .speed_hz = speed,
-        .bits_per_word = bits,
-    };
-
-    //The actual transfer command and data, does send and receive!! Very important!
-    ret = ioctl(self->fd, SPI_IOC_MESSAGE(1), &transfer);
-    if (ret < 1)
-    {
-        printf("ERROR: Can't send spi message");
-        perror(0);
-    }
-
-#ifdef VERBOSE_MODE
-    //This part prints the Received data of the SPI transmission of equal size to TX
-    //printf("Data that was received from SPI!!  RX:  ");
-
-    for (i = 0; i < transfer_length; i++)
-    {
-        if (!(i % 6))
-        {
-            puts("");
-        }
-        printf("%.2X ", rx_buf[i]);
-    }
-    puts(""); // newline
-#endif
-
-    //return rx data
-    PyObject * rx_tuple = PyTuple_New(transfer_length);
-    for (i=0; i < transfer_length; i++)
-        PyTuple_SetItem(rx_tuple, i, PyInt_FromLong(rx_buf[i]));
-
-    return rx_tuple;
-}
-
-PyDoc_STRVAR(SPI_open_doc,
-        "open(bus, device)\n\n"
-        "Connects the object to the specified SPI device.\n"
-        "open(X,Y) will open /dev/spidev-X.Y\n");
-
-static PyObject *SPI_open(SPI *self, PyObject *args, PyObject *kwds)
-{
-    int bus, device;
-    char path[MAXPATH];
-    uint8_t tmp8;
-    uint32_t tmp32;
-    static char *kwlist[] = { "bus", "device", NULL };
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii:open", kwlist, &bus,
-            &device))
-    {
-        return NULL;
-    }
-
-    if (snprintf(path, MAXPATH, "/dev/spidev%d.%d", bus, device) >= MAXPATH)
-    {
-        PyErr_SetString(PyExc_OverflowError,
-                "Bus and/or device number is invalid.");
-        return NULL;
-    }
-
-    if ((self->fd = open(path, O_RDWR, 0)) < 0)
-    {
-        char err_str[20 + MAXPATH];
-        sprintf(err_str, "can't open device: %s", path);
-        PyErr_SetString(SpiError, err_str);
-        return 0; // trigger exception
-    }
-
-    if (ioctl(self->fd, SPI_IOC_RD_MODE, &tmp8) == -1)
-    {
-        PyErr_SetString(SpiError, "can't get spi mode");
-        return 0; // trigger exception
-    }
-
-    self->mode = tmp8;
-    if (ioctl(self->fd, SPI_IOC_RD_BITS_PER_WORD, &tmp8) == -1)
-    {
-        PyErr_SetString(SpiError, "can't get bits per word");
-        return 0; // trigger exception
-    }
-
-    self->bpw = tmp8;
-    if (ioctl(self->fd, SPI_IOC_RD_MAX_SPEED_HZ, &tmp32) == -1)
-    {
-        PyErr_SetString(SpiError, "can't get max speed hz");
-        return 0; // trigger exception
-    }
-    self->msh = tmp32;
-
-    Py_INCREF(Py_None);
-    return Py_None;
-}
-
-static int SPI_init(SPI *self, PyObject *args, PyObject *kwds)
-{
-    int bus = -1;
-    int client = -1;
-    static char *kwlist[] =
-    { "bus", "client", NULL };
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ii:__init__", kwlist, &bus,
-            &client))
-        return -1;
-
-    if (bus >= 0)
-    {
-        SPI_open(self, args, kwds);
-        if (PyErr_Occurred())
-            return -1;
-    }
-    return 0;
-}
-
-static PyMethodDef SPI_module_methods[] =
-{
-        { NULL },
-};
-
-PyDoc_STRVAR(SPI_type_doc,
-        "SPI([bus],[client]) -> SPI\n\n"
-        "Return a new SPI object that is (optionally) connected to the\n"
-        "specified SPI device interface.\n");
-
-static PyMethodDef SPI_methods[] =
-{
-    { "open", (PyCFunction) SPI_open, METH_VARARGS | METH_KEYWORDS, SPI_open_doc },
-    { "close", (PyCFunction) SPI_close, METH_NOARGS, SPI_close_doc },
-    { "transfer", (PyCFunction) SPI_transfer, METH_VARARGS, SPI_transfer_doc },
-    { NULL },
-};
-
-static PyTypeObject SPI_type =
-{
-    PyObject_HEAD_INIT(NULL)
-    0,                 /* ob_size */
-    "SPI",             /* tp_name */
-    sizeof(SPI),     /* tp_basicsize */
-    0, /* tp_itemsize */
-    0, /* tp_dealloc */
-    0, /* tp_print */
-    0, /* tp_getattr */
-    0, /* tp_setattr */
-    0, /* tp_compare */
-    0, /* tp_repr */
-    0, /* tp_as_number */
-    0, /* tp_as_sequence */
-    0, /* tp_as_mapping */
-    0, /* tp_hash */
-    0, /* tp_call */
-    0, /* tp_str */
-    0, /* tp_getattro */
-    0, /* tp_setattro */
-    0, /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT, /* tp_flags */
-    SPI_type_doc, /* tp_doc */
-    0, /* tp_traverse */
-    0, /* tp_clear */
-    0, /* tp_richcompare */
-    0, /* tp_weaklistoffset */
-    0, /* tp_iter */
-    0, /* tp_iternext */
-    SPI_methods, /* tp_methods */
-    0, /* tp_members */
-    0, /* tp_getset */
-    0, /* tp_base */
-    0, /* tp_dict */
-    0, /* tp_descr_get */
-    0, /* tp_descr_set */
-    0, /* tp_dictoffset */
-    (initproc)SPI_init, /* tp_init */
-    0, /* tp_alloc */
-    SPI_new, /* tp_new */
-};
-
-#ifndef PyMODINIT_FUNC    /* declarations for DLL import/export */
-#define PyMODINIT_FUNC void
-#endif
-
-PyMODINIT_FUNC
-initspipy(void)
-{
-    PyObject* m;
-
-    if (PyType_Ready(&SPI_type) < 0)
-        return;
-
-    m = Py_InitModule3("spipy", SPI_module_methods, SPI_module_doc);
-    Py_INCREF(&SPI_type);
-    PyModule_AddObject(m, "SPI", (PyObject *) &SPI_type);
-
-    // make a new exception
-    SpiError = PyErr_NewException("spi.error", NULL, NULL);
-    Py_INCREF(SpiError);
-    PyModule_AddObject(m, "error", SpiError);
-}
+/*
+ * spipy.c - Python bindings for Linux SPI access through spidev
+ * Copyright (C) 2009 Volker Thoms <unconnected@gmx.de>
+ * Copyright (C) 2013 Thomas Preston <thomasmarkpreston@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <Python.h>
+#include "structmember.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <linux/spi/spidev.h>
+#include <linux/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+//#define VERBOSE_MODE // comment out to turn off debugging
+
+/*
+ * USDT probes for perf and bpftrace, e.g. usdt:spipy.so:spipy:ioctl_return.
+ * Every probe gets the handle, a length in bytes and a segment count;
+ * they are single nops until a tracer attaches, and vanish entirely
+ * when sys/sdt.h (systemtap-sdt-dev) isn't installed.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SPI_PROBE(name, self, len, segs) \
+    DTRACE_PROBE3(spipy, name, (uintptr_t) (self), (len), (segs))
+#define SPI_PROBE_RET(name, self, len, segs, ret) \
+    DTRACE_PROBE4(spipy, name, (uintptr_t) (self), (len), (segs), (ret))
+#endif
+#endif
+#ifndef SPI_PROBE
+#define SPI_PROBE(name, self, len, segs) do { } while (0)
+#define SPI_PROBE_RET(name, self, len, segs, ret) do { } while (0)
+#endif
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define MAXPATH 16
+#define MAX_TRANSFER_LENGTH 256
+
+/* message parameters used by transfer() and the scheduler */
+#define TRANSFER_BITS 8
+#define TRANSFER_DELAY_USECS 5
+#define TRANSFER_SPEED_HZ 1000000 /* until set_speed() or autotune() */
+
+/* clock autotuning, see spi_tune_* below */
+#define TUNE_MIN_HZ 100000
+#define TUNE_RESOLUTION 50 /* search down to 1/50th of the speed */
+
+#define SPIDEV_BUFSIZ_PATH "/sys/module/spidev/parameters/bufsiz"
+#define SPIDEV_BUFSIZ 4096 /* spidev's default when the above is missing */
+#define SPI_MASTER_STATS "/sys/class/spi_master/spi%d/statistics/"
+#define SPI_DEVICE_STATS "/sys/bus/spi/devices/spi%d.%d/statistics/"
+#define KSTAT_COUNTERS 11
+#define KSTAT_HISTO 17  /* transfer_bytes_histo_0-1 ... _65536+ */
+#define KSTAT_FILES (KSTAT_COUNTERS + KSTAT_HISTO)
+#define TRACE_MARKER "/sys/kernel/tracing/trace_marker"
+#define TRACE_MARKER_DEBUGFS "/sys/kernel/debug/tracing/trace_marker"
+#define TRACE_MARKER_MAX 32
+#define TRACE_RECORDS 65536 /* default trace_start() ring, a power of two */
+#define TRACE_TRACKS 256
+#define UTIL_BUSES 16     /* buses with utilization windows, 0 to 15 */
+#define UTIL_SECONDS 64   /* per second history, covers the 60s window */
+
+/* publish_stats() shared memory, see struct spi_pubstats */
+#define PUB_MAGIC 0x54535053 /* "SPST" */
+#define PUB_VERSION 1
+#define PUB_LAT_BUCKETS 32
+#define PUB_NAME_MAX 64
+#define PUB_READ_TRIES 10000
+
+/* start_sampler() shared memory, see struct spi_sample */
+#define SAMPLE_MAGIC 0x504d5053 /* "SPMP" */
+#define SAMPLE_VERSION 1
+
+/* buffer arena, see spi_arena_* below */
+#define CACHELINE_SIZE 64
+#define HUGEPAGE_SIZE (2UL << 20)
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+enum
+{
+    ARENA_HUGEPAGES = 1 << 0,
+    ARENA_LOCKED = 1 << 1,
+};
+
+/* flat combining, see spi_combine_* below */
+#define COMBINE_SLOTS 16
+#define COMBINE_MAX_SEGS 64
+#define COMBINE_POLL_MS 1
+
+/* write-only micro batching, see spi_batch_* below */
+#define BATCH_MAX_ENTRIES 64
+
+/* bulk streaming, see spi_pipe_* and spi_prefix_* below */
+#define PREFIX_MAX 16
+#define FLASH_MAX_DUMMY 4
+#define BULK_MAX_SEGS 64
+#define CALIBRATE_BYTES (16 << 10) /* default bytes moved per setting */
+#define PROGRESS_EVERY (1 << 20) /* default bytes between progress calls */
+#define DIRECT_ALIGN 512 /* O_DIRECT write granularity */
+
+/* deadline scheduler, see spi_sched_* below */
+#define SCHED_MAX_JOBS 32
+#define SCHED_SLICE_MS 100 /* how often run() comes back to check signals */
+
+/* where an SPI object's messages go */
+enum
+{
+    BACKEND_DEVICE = 0,       /* /dev/spidevX.Y */
+    BACKEND_BROKER,           /* a broker process, see spipy.serve() */
+    BACKEND_MOCK,             /* an emulated loopback device */
+};
+
+#define MOCK_MAX_SPEED_HZ 10000000
+
+#define FAULT_MAX_ERRNOS 8
+
+/* bus widths, from linux/spi/spi.h on newer kernels */
+#ifndef SPI_TX_DUAL
+#define SPI_TX_DUAL 0x100
+#define SPI_TX_QUAD 0x200
+#define SPI_RX_DUAL 0x400
+#define SPI_RX_QUAD 0x800
+#endif
+
+/* shared memory bus broker, see spi_broker_* below */
+#define BROKER_MAGIC 0x53504942 /* "SPIB" */
+#define BROKER_VERSION 4
+#define BROKER_SLOTS 16
+#define BROKER_MAX_SEGS 8
+#define BROKER_PAYLOAD 4096
+#define BROKER_POLL_MS 100 /* how often a waiter checks its peer is alive */
+
+/* cross process bus lock, see spi_buslock_* below */
+#define BUSLOCK_MAGIC 0x5350494d /* "SPIM" */
+#define BUSLOCK_MAX_WAITERS 32
+#define BUSLOCK_POLL_MS 10 /* how often waiters look for dead peers */
+#define QUIESCE_POLL_MS 1 /* how often close() looks for calls still running */
+
+enum
+{
+    PRIO_BULK = 0,
+    PRIO_NORMAL,
+    PRIO_CRITICAL,
+    PRIO_CLASSES,
+};
+
+enum
+{
+    SLOT_FREE = 0,
+    SLOT_CLAIMED,
+    SLOT_SUBMITTED,
+    SLOT_DONE,
+};
+
+PyDoc_STRVAR(SPI_module_doc,
+        "This module defines an object type that allows SPI transactions\n"
+        "on hosts running the Linux kernel. The host kernel must have SPI\n"
+        "support and SPI device interface support.\n"
+        "All of these can be either built-in to the kernel, or loaded from\n"
+        "modules.\n"
+        "\n"
+        "Because the SPI device interface is opened R/W, users of this\n"
+        "module usually must have root permissions.\n");
+
+/*
+ * The broker is a process which owns /dev/spidevX.Y and runs messages on
+ * behalf of its clients. Clients and broker share a table of slots in
+ * /dev/shm/spipy-X.Y; each slot holds one message (segment descriptors and
+ * payload) and its state word doubles as the futex the client sleeps on.
+ * The broker serves slots round robin so no client can starve another.
+ */
+struct spi_broker_seg
+{
+    uint32_t len;
+    uint32_t speed_hz;
+    uint16_t delay_usecs;
+    uint8_t bits_per_word;
+    uint8_t cs_change;
+    uint8_t tx_nbits;
+    uint8_t rx_nbits;
+};
+
+struct spi_broker_slot
+{
+    volatile uint32_t state;  /* SLOT_*, futex word */
+    volatile pid_t owner;     /* client using the slot, 0 when unknown */
+    int32_t result;           /* ioctl return value */
+    int32_t error;            /* errno when result < 0 */
+    uint32_t nsegs;
+    struct spi_broker_seg seg[BROKER_MAX_SEGS];
+    unsigned char data[BROKER_PAYLOAD]; /* tx in, rx out */
+};
+
+struct spi_broker
+{
+    uint32_t magic;
+    uint32_t version;
+    pid_t pid;                /* broker process */
+    uint32_t mode;
+    uint8_t bpw;
+    uint32_t msh;
+    volatile uint32_t doorbell; /* bumped on every submit, futex word */
+    volatile uint32_t freed;    /* bumped on every slot release, futex word */
+    volatile uint32_t next;     /* slot allocation hint */
+    struct spi_broker_slot slot[BROKER_SLOTS];
+};
+
+/*
+ * The bus lock lives in /dev/shm/spipy-lock-X.Y and serializes message
+ * sequences between processes that open the device directly. Ownership is
+ * decided entirely under "gate": an acquirer registers in waiter[] and
+ * sleeps on "turn" until the bus is free and nobody of a higher priority
+ * class is waiting, so a critical waiter always goes before bulk ones
+ * that arrived earlier. The owner is recorded by pid and thread id, so a
+ * holder dying never wedges the device, and the lock nests, so a thread
+ * holding it for a sequence can still send the individual messages.
+ */
+struct spi_buslock_waiter
+{
+    pid_t pid;                /* 0 when the entry is unused */
+    int32_t prio;
+};
+
+struct spi_buslock
+{
+    volatile uint32_t magic;
+    pthread_mutex_t gate;     /* protects everything below */
+    volatile uint32_t turn;   /* bumped whenever the bus may have freed, futex word */
+    volatile pid_t owner;     /* thread id holding the bus, 0 if none */
+    pid_t owner_pid;          /* process of owner */
+    uint32_t depth;           /* recursion depth of owner */
+    uint32_t recovered;       /* times a dead holder was cleaned up */
+    uint32_t waiting[PRIO_CLASSES]; /* registered waiters per class */
+    struct spi_buslock_waiter waiter[BUSLOCK_MAX_WAITERS];
+};
+
+/*
+ * A scheduled transaction. Periodic jobs are released every period_ns,
+ * one-shot jobs once; either must finish within deadline_ns of release.
+ * Long jobs run in chunks of at most sched->chunk bytes, and the next
+ * chunk only goes out if the job is still the earliest deadline.
+ */
+struct spi_job
+{
+    int id;                   /* 0 when the entry is unused */
+    int prio;                 /* PRIO_*, breaks deadline ties */
+    uint64_t period_ns;       /* 0 for one-shot */
+    uint64_t deadline_ns;     /* relative, 0 for none */
+    uint64_t offset_ns;       /* first release, relative to run() */
+    int started;              /* release is set, run() has seen the job */
+    uint64_t release;         /* absolute, CLOCK_MONOTONIC ns */
+    uint64_t due;             /* absolute deadline of this instance */
+    unsigned char *tx;        /* arena, rx follows on the next cacheline */
+    unsigned char *rx;
+    size_t len;
+    size_t alloc;             /* arena size behind tx and rx */
+    size_t done;              /* bytes of this instance already sent */
+    int finished;             /* one-shot job has run */
+    volatile int cancelled;   /* freed once run() returns */
+    uint32_t runs;
+    uint32_t misses;
+    uint64_t worst_late_ns;
+};
+
+struct spi_sched
+{
+    struct spi_job job[SCHED_MAX_JOBS];
+    int next_id;
+    size_t chunk;             /* largest single message, spidev's bufsiz */
+    int running;              /* run() is dispatching without the GIL */
+    volatile uint32_t doorbell; /* bumped by schedule() during run(), futex word */
+};
+
+/*
+ * Flat combining: a thread publishes its message in a slot and then
+ * either becomes the combiner, by taking the lock, or sleeps on its slot.
+ * The combiner sends every published message as one SPI_IOC_MESSAGE,
+ * with cs_change set between them, and hands each thread its result.
+ * Slots move through the same SLOT_* states as broker slots.
+ */
+struct spi_comb_slot
+{
+    volatile uint32_t state;  /* SLOT_*, futex word */
+    struct spi_ioc_transfer *xfer;
+    unsigned int n;
+    int result;
+    int error;
+};
+
+struct spi_combiner
+{
+    pthread_mutex_t lock;
+    struct spi_comb_slot slot[COMBINE_SLOTS];
+};
+
+/*
+ * Write-only transfers queued by write() in autobatch mode. They go out
+ * as one message, CS released between entries, once max_entries are
+ * queued, once the oldest has waited window_ns (the flusher thread sees
+ * to that), or before anything that reads from the device.
+ */
+struct spi_batch
+{
+    pthread_mutex_t lock;     /* protects everything below, held over flush */
+    pthread_cond_t wake;      /* tells the flusher a window has opened */
+    pthread_t flusher;
+    int stop;
+    unsigned int max_entries;
+    uint64_t window_ns;
+    unsigned int count;
+    size_t used;
+    size_t size;              /* of data, spidev's bufsiz */
+    size_t alloc;             /* arena size behind data */
+    uint64_t first;           /* when the oldest queued entry arrived */
+    int error;                /* errno of a failed background flush */
+    unsigned int lockers;     /* threads waiting for the bus lock */
+    void *owner;              /* SPI handle the flusher sends on */
+    struct spi_ioc_transfer xfer[BATCH_MAX_ENTRIES];
+    unsigned char *data;
+};
+
+/*
+ * Two buffers passed back and forth between a producer and a consumer
+ * thread, so that one can be filled while the other is drained. Either
+ * side stops both by setting error.
+ */
+struct spi_pipe
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char *buf[2];
+    size_t len[2];
+    int full[2];
+    int eof;                  /* the producer has finished */
+    int error;                /* errno that stopped the pipe */
+    size_t size;              /* of each buffer */
+    size_t alloc;             /* arena size behind both */
+};
+
+/*
+ * Command bytes sent ahead of every chunk of a bulk transfer, in the
+ * same message and with CS held: the fixed prefix, then optionally an
+ * address of addr_bytes, big endian, advanced by each chunk's length.
+ */
+struct spi_prefix
+{
+    unsigned char buf[PREFIX_MAX + 4 + FLASH_MAX_DUMMY];
+    size_t cmd_len;
+    int addr_bytes;           /* 0 for no address */
+    uint32_t address;
+    int dummy_bytes;          /* zeros after the address */
+    uint8_t addr_nbits;       /* bus widths, see spi_flash_protocol() */
+    uint8_t data_nbits;
+};
+
+/*
+ * What autotune() found the link could do, and how to check it still
+ * can: the probe pattern, the reply expected for it and how often to
+ * look again.
+ */
+struct spi_tune
+{
+    pthread_mutex_t lock;     /* held while re-verifying, guards rx */
+    unsigned char *probe;
+    unsigned char *expected;
+    unsigned char *rx;        /* what each trial read back */
+    size_t len;
+    size_t alloc;             /* arena size behind probe, expected and rx */
+    int trials;
+    double margin;            /* fraction of the fastest passing speed used */
+    uint32_t min_hz;
+    uint32_t max_hz;
+    uint32_t limit_hz;        /* fastest speed that passed */
+    uint64_t interval_ns;     /* re-verify this often, 0 for never */
+    uint64_t last;            /* when it last passed */
+    uint32_t retunes;         /* times re-verification failed */
+};
+
+/*
+ * Token bucket: rate tokens per second accrue up to burst. A message
+ * waits until the bucket holds its cost (or the whole burst, for messages
+ * larger than that) and then takes it, possibly into debt, so the long
+ * term rate is honoured exactly. rate 0 means unlimited.
+ */
+struct spi_bucket
+{
+    double rate;
+    double burst;
+    double tokens;
+    uint64_t last;            /* CLOCK_MONOTONIC ns of last refill */
+};
+
+/* per-handle counters, see stats() */
+struct spi_stats
+{
+    uint64_t transfers;       /* messages sent */
+    uint64_t segments;        /* spi_ioc_transfers in those messages */
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t throttled;       /* messages delayed by the rate limit */
+    uint64_t throttle_ns;     /* total time spent waiting for tokens */
+    uint64_t io_ns;           /* total time in the ioctl or other backend */
+};
+
+/*
+ * Faults the mock backend injects, see set_faults(). Every decision is
+ * drawn from one seeded generator, so a single threaded run is
+ * repeatable.
+ */
+struct spi_faults
+{
+    pthread_mutex_t lock;     /* protects rng, busy_left and the counts */
+    uint64_t rng;
+    double error_rate;        /* per message */
+    int errnos[FAULT_MAX_ERRNOS];
+    int nerrnos;
+    double flip_rate;         /* per received byte */
+    double latency_rate;      /* per message */
+    uint64_t latency_ns;
+    double busy_rate;         /* per message, starts a stuck busy spell */
+    unsigned int busy_messages;
+    unsigned int busy_left;
+    uint8_t busy_mask;        /* ORed into the first byte of each rx */
+    uint64_t errors;          /* injected so far */
+    uint64_t flips;
+    uint64_t delays;
+    uint64_t busy;
+};
+
+/*
+ * The kernel's statistics for the controller and the device, kept open
+ * for kernel_stats() and read with pread(). last and user hold the
+ * values at the previous call, for the deltas.
+ */
+struct spi_kstats
+{
+    int fd[2][KSTAT_FILES];   /* controller, device; -1 when missing */
+    uint64_t last[2][KSTAT_FILES];
+    struct spi_stats user;
+    uint64_t when;
+};
+
+/*
+ * The layout publish_stats() exports for readers in other processes,
+ * native endian. Readers check magic and version, and copy the whole
+ * thing until seq is even and unchanged across the copy. latency[i]
+ * counts messages that spent under 2^i usec in the driver (the last
+ * bucket takes the rest).
+ */
+struct spi_pubstats
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;            /* sizeof(struct spi_pubstats) */
+    uint32_t seq;             /* odd while being written */
+    int32_t pid;
+    int32_t bus;
+    int32_t device;
+    uint32_t lat_buckets;     /* PUB_LAT_BUCKETS */
+    uint64_t transfers;
+    uint64_t segments;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t throttled;
+    uint64_t throttle_ns;
+    uint64_t io_ns;
+    uint64_t latency[PUB_LAT_BUCKETS];
+};
+
+/*
+ * The latest reading from start_sampler(), for readers in any process.
+ * One writer, the sampler thread; readers copy it until seq is even and
+ * unchanged across the copy. count is the sample number, error the
+ * errno of a failed transfer (data then holds the last good reading).
+ */
+struct spi_sample
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;            /* sizeof(struct spi_sample) */
+    uint32_t seq;             /* odd while being written */
+    int32_t pid;
+    int32_t bus;
+    int32_t device;
+    int32_t error;
+    uint64_t count;
+    uint64_t mono_ns;         /* CLOCK_MONOTONIC at the end of the transfer */
+    uint64_t real_ns;         /* CLOCK_REALTIME likewise */
+    uint32_t len;
+    uint32_t reserved;
+    unsigned char data[MAX_TRANSFER_LENGTH];
+};
+
+struct spi_sampler
+{
+    pthread_t thread;
+    volatile uint32_t stop;
+    uint64_t interval_ns;
+    struct spi_ioc_transfer xfer;
+    unsigned char tx[MAX_TRANSFER_LENGTH];
+    unsigned char rx[MAX_TRANSFER_LENGTH];
+    uint16_t keep_idx[MAX_TRANSFER_LENGTH];
+    int keep_length;          /* -1 to publish every byte */
+    struct spi_sample *shm;
+    char name[PUB_NAME_MAX];
+};
+
+/*
+ * One message as seen by trace_export(). The ring is shared by every
+ * handle in the process; writers claim a record with an atomic add on
+ * head and publish it by setting seq, the exporter skips records whose
+ * seq changes under it.
+ */
+struct spi_trace_rec
+{
+    uint64_t seq;             /* claim number + 1, 0 while being written */
+    uint64_t start;           /* CLOCK_MONOTONIC ns, bus lock held */
+    uint64_t end;
+    uint32_t bytes;
+    uint16_t segments;
+    int16_t bus;
+    int16_t device;
+    int32_t tid;              /* thread that sent the message */
+    int32_t result;           /* ioctl result, or -errno */
+};
+
+static struct
+{
+    int enabled;
+    uint64_t mask;            /* records - 1 */
+    uint64_t head;            /* records claimed so far */
+    uint64_t epoch;           /* trace_start() time, exported as 0 */
+    struct spi_trace_rec *rec;
+} spi_trace;
+
+static __thread pid_t spi_tid;
+
+/* one second of one bus's activity, see utilization() */
+struct spi_util_sec
+{
+    uint64_t sec;             /* CLOCK_MONOTONIC second this covers */
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t busy_ns;         /* time messages spent in the driver */
+    uint64_t wire_ns;         /* time their bits take at their clock */
+    uint64_t gaps;            /* idle periods between messages */
+    uint64_t gap_ns;
+    uint64_t max_gap_ns;
+    uint64_t reconfigs;       /* segments needing new mode, speed or width */
+};
+
+static struct spi_util
+{
+    pthread_mutex_t lock;
+    uint64_t first;           /* start of the first message seen */
+    uint64_t last_end;
+    uint64_t last_cfg;        /* spi_cfg_key() of the last segment */
+    struct spi_util_sec sec[UTIL_SECONDS];
+} spi_util[UTIL_BUSES];
+
+/*
+ * SPIBufferPool hands out SPIBuffers: fixed size, page aligned slices of
+ * one arena. A buffer goes back on the pool's free list when the last
+ * reference to it is dropped.
+ */
+typedef struct
+{
+    PyObject_HEAD
+
+    unsigned char *arena;
+    size_t alloc;           /* arena size */
+    size_t size;            /* usable bytes per buffer */
+    size_t stride;          /* distance between buffers, page aligned */
+    int count;
+    int nfree;
+    int *free;              /* stack of free buffer indices */
+} SPIBufferPool;
+
+typedef struct
+{
+    PyObject_HEAD
+
+    SPIBufferPool *pool;
+    unsigned char *data;
+    Py_ssize_t size;
+    int index;
+} SPIBuffer;
+
+typedef struct
+{
+    PyObject_HEAD
+
+    int fd;         /* open file descriptor: /dev/spi-X.Y */
+    uint32_t mode;    /* current SPI mode, with the SPI_TX/RX_* widths */
+    uint8_t bpw;     /* current SPI bits per word setting */
+    uint32_t msh;     /* current SPI max speed setting in Hz */
+    int bus;          /* X in /dev/spidevX.Y */
+    int device;       /* Y in /dev/spidevX.Y */
+    struct spi_broker *broker; /* set when messages go through a broker */
+    struct spi_buslock *buslock; /* set when sharing the bus lock */
+    int prio;         /* PRIO_* class used for the bus lock */
+    struct spi_sched *sched; /* created by the first schedule() */
+    pthread_mutex_t lock;     /* protects the buckets, serialises pub writes */
+    struct spi_bucket byte_bucket;
+    struct spi_bucket xfer_bucket;
+    struct spi_stats stats;
+    struct spi_combiner *combiner; /* created by set_combining() */
+    int combining;
+    struct spi_batch *batch;  /* created by set_autobatch() */
+    int mock;                 /* emulate the device, see spi_mock_message() */
+    struct spi_faults *faults; /* created by set_faults(), mock only */
+    int ring_size;            /* result ring, see set_result_ring() */
+    int ring_next;
+    PyObject **ring_buf;      /* SPIBuffers holding the results */
+    PyObject **ring_view;     /* read-only memoryviews handed out */
+    uint32_t speed;           /* speed_hz for messages from this handle */
+    struct spi_tune *tune;    /* created by autotune() */
+    size_t seg_size;          /* bulk segment size from calibrate(), 0 for one */
+    unsigned int batch_depth; /* bulk segments per message from calibrate() */
+    struct spi_kstats *kstats; /* opened by kernel_stats() */
+    int trace_fd;             /* trace_marker, see set_trace_markers() */
+    char trace_begin[TRACE_MARKER_MAX];
+    char trace_end[TRACE_MARKER_MAX];
+    size_t trace_begin_len;
+    size_t trace_end_len;
+    struct spi_pubstats *pub; /* mapped by publish_stats() */
+    char pub_name[PUB_NAME_MAX];
+    struct spi_sampler *sampler; /* created by start_sampler() */
+    int users[2];             /* threads inside SPI_BEGIN_ALLOW_THREADS(), */
+    int epoch;                /* counted under users[epoch] */
+    int closing;              /* close() is waiting for users to leave */
+    int swapping;             /* set_autobatch()/autotune() replacing state */
+} SPI;
+
+/*
+ * Release the GIL for work on the handle. close() and the calls that
+ * replace per-handle state wait, in SPI_quiesce(), until threads that
+ * may still see the old state have left before freeing it. Once close()
+ * has started, new callers aren't counted; SPI_closed() fails them
+ * before they touch anything.
+ */
+#define SPI_BEGIN_ALLOW_THREADS(self) \
+    { int _spi_epoch = SPI_enter(self); Py_BEGIN_ALLOW_THREADS
+#define SPI_END_ALLOW_THREADS(self) \
+    Py_END_ALLOW_THREADS SPI_leave(self, _spi_epoch); }
+
+/* Called with the GIL held. Returns the epoch for SPI_leave(). */
+static int SPI_enter(SPI *self)
+{
+    if (self->closing)
+        return -1;
+    self->users[self->epoch]++;
+    return self->epoch;
+}
+
+static void SPI_leave(SPI *self, int epoch)
+{
+    if (epoch >= 0)
+        self->users[epoch]--;
+}
+
+/* Whether close() has started, failing with EBADF if so. GIL released. */
+static int SPI_closed(SPI *self)
+{
+    if (!self->closing)
+        return 0;
+    errno = EBADF;
+    return 1;
+}
+
+static PyObject * SpiError; // special exception
+
+static uint64_t spi_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void spi_sleep_until(uint64_t when)
+{
+    struct timespec ts = {
+        .tv_sec = when / 1000000000ULL,
+        .tv_nsec = when % 1000000000ULL,
+    };
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* spidev refuses messages larger than its bufsiz module parameter */
+static size_t spi_bufsiz(void)
+{
+    static size_t bufsiz;
+    unsigned long val;
+    FILE *f;
+
+    if (bufsiz == 0)
+    {
+        bufsiz = SPIDEV_BUFSIZ;
+        if ((f = fopen(SPIDEV_BUFSIZ_PATH, "r")) != NULL)
+        {
+            if (fscanf(f, "%lu", &val) == 1 && val > 0)
+                bufsiz = val;
+            fclose(f);
+        }
+    }
+    return bufsiz;
+}
+
+/*
+ * Buffers for bulk data come straight from mmap: page aligned, faulted in
+ * up front and optionally backed by hugepages and locked in memory, so
+ * streaming loops never take a page fault or go through malloc. *size is
+ * rounded up to whole pages. Returns NULL with errno set on failure.
+ */
+static void *spi_arena_alloc(size_t *size, int flags)
+{
+    size_t align = (flags & ARENA_HUGEPAGES) ? HUGEPAGE_SIZE
+            : (size_t) sysconf(_SC_PAGESIZE);
+    int mflags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+    void *p = MAP_FAILED;
+    int err;
+
+    *size = ALIGN_UP(*size ? *size : 1, align);
+
+#ifdef MAP_HUGETLB
+    if (flags & ARENA_HUGEPAGES)
+        p = mmap(NULL, *size, PROT_READ | PROT_WRITE, mflags | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED)
+    {
+        /* no hugetlbfs pages reserved, settle for transparent hugepages */
+        if ((p = mmap(NULL, *size, PROT_READ | PROT_WRITE, mflags, -1, 0)) == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        if (flags & ARENA_HUGEPAGES)
+            madvise(p, *size, MADV_HUGEPAGE);
+#endif
+    }
+
+    if ((flags & ARENA_LOCKED) && mlock(p, *size) == -1)
+    {
+        err = errno;
+        munmap(p, *size);
+        errno = err;
+        return NULL;
+    }
+    return p;
+}
+
+static void spi_arena_free(void *p, size_t size)
+{
+    if (p != NULL)
+        munmap(p, size);
+}
+
+/*
+ * Convert a PySequence_Fast of 8-bit values into buf, which must hold
+ * PySequence_Fast_GET_SIZE(seq) bytes.
+ */
+static int spi_seq_to_buf(PyObject *seq, unsigned char *buf)
+{
+    Py_ssize_t i, n = PySequence_Fast_GET_SIZE(seq);
+    long tx_char;
+
+    for (i = 0; i < n; i++)
+    {
+        tx_char = PyInt_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+        if(tx_char > 255 || tx_char < 0)
+        {
+            PyErr_SetString(PyExc_AttributeError, "Transmit data should be valid 8-bit data");
+            return -1;
+        }
+        buf[i] = (unsigned char)tx_char;
+    }
+    return 0;
+}
+
+/*
+ * Turn a keep= selector into the list of rx offsets to return, for a
+ * transfer of len bytes. The selector is a slice, a sequence of offsets
+ * (negative ones count from the end) or an integer bitmask in which bit
+ * i keeps byte i. Returns the number of offsets, or -1 on error.
+ */
+static int spi_parse_keep(PyObject *keep, Py_ssize_t len, uint16_t *idx)
+{
+    unsigned char mask[MAX_TRANSFER_LENGTH / 8];
+    Py_ssize_t i, n = 0, start, stop, step, slicelength;
+    PyObject *seq;
+    long off;
+
+    if (PySlice_Check(keep))
+    {
+        if (PySlice_GetIndicesEx((PySliceObject *) keep, len, &start, &stop,
+                &step, &slicelength) < 0)
+            return -1;
+        for (i = 0; i < slicelength; i++)
+            idx[n++] = start + i * step;
+        return n;
+    }
+
+    if (PyInt_Check(keep) || PyLong_Check(keep))
+    {
+        memset(mask, 0, sizeof(mask));
+        if (PyInt_Check(keep))
+        {
+            unsigned long val = (unsigned long) PyInt_AsLong(keep);
+            for (i = 0; i < (Py_ssize_t) sizeof(val); i++)
+                mask[i] = val >> (8 * i);
+        }
+        else if (_PyLong_AsByteArray((PyLongObject *) keep, mask, sizeof(mask),
+                1, 0) < 0)
+        {
+            return -1;
+        }
+        for (i = 0; i < len; i++)
+            if (mask[i / 8] & (1 << (i % 8)))
+                idx[n++] = i;
+        return n;
+    }
+
+    if ((seq = PySequence_Fast(keep, "keep must be a slice, offsets or a bitmask")) == NULL)
+        return -1;
+    if (PySequence_Fast_GET_SIZE(seq) > MAX_TRANSFER_LENGTH)
+    {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_OverflowError, "too many offsets to keep");
+        return -1;
+    }
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++)
+    {
+        off = PyInt_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+        if (off == -1 && PyErr_Occurred())
+        {
+            Py_DECREF(seq);
+            return -1;
+        }
+        if (off < 0)
+            off += len;
+        if (off < 0 || off >= len)
+        {
+            Py_DECREF(seq);
+            PyErr_SetString(PyExc_IndexError, "keep offset out of range");
+            return -1;
+        }
+        idx[n++] = off;
+    }
+    Py_DECREF(seq);
+    return n;
+}
+
+/*
+ * Bytes handed in from Python: either borrowed from an object that
+ * supports the buffer protocol, or converted from a sequence of ints
+ * into a private copy.
+ */
+struct spi_bytes
+{
+    Py_buffer view;
+    int is_view;
+    int is_borrowed;          /* buf belongs to an old style buffer */
+    unsigned char *buf;
+    Py_ssize_t len;
+};
+
+static int spi_bytes_get(PyObject *obj, struct spi_bytes *b)
+{
+    PyObject *seq;
+    const void *ptr;
+
+    memset(b, 0, sizeof(*b));
+    if (PyObject_CheckBuffer(obj))
+    {
+        if (PyObject_GetBuffer(obj, &b->view, PyBUF_SIMPLE) < 0)
+            return -1;
+        b->is_view = 1;
+        b->buf = b->view.buf;
+        b->len = b->view.len;
+        return 0;
+    }
+
+    if (PyObject_CheckReadBuffer(obj))
+    {
+        /* old style buffers, e.g. mmap.mmap; obj must outlive the use */
+        if (PyObject_AsReadBuffer(obj, &ptr, &b->len) < 0)
+            return -1;
+        b->buf = (unsigned char *) ptr;
+        b->is_borrowed = 1;
+        return 0;
+    }
+
+    if ((seq = PySequence_Fast(obj, "Expected a sequence type")) == NULL)
+        return -1;
+    b->len = PySequence_Fast_GET_SIZE(seq);
+    if ((b->buf = malloc(b->len ? b->len : 1)) == NULL)
+    {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (spi_seq_to_buf(seq, b->buf) < 0)
+    {
+        Py_DECREF(seq);
+        free(b->buf);
+        b->buf = NULL;
+        return -1;
+    }
+    Py_DECREF(seq);
+    return 0;
+}
+
+static void spi_bytes_release(struct spi_bytes *b)
+{
+    if (b->is_view)
+        PyBuffer_Release(&b->view);
+    else if (!b->is_borrowed)
+        free(b->buf);
+    memset(b, 0, sizeof(*b));
+}
+
+static PyObject *spi_buf_to_tuple(const unsigned char *buf, size_t len)
+{
+    PyObject *tuple;
+    size_t i;
+
+    if ((tuple = PyTuple_New(len)) == NULL)
+        return NULL;
+    for (i = 0; i < len; i++)
+        PyTuple_SET_ITEM(tuple, i, PyInt_FromLong(buf[i]));
+    return tuple;
+}
+
+/*
+ * What the controller has to be programmed with for a segment; messages
+ * with the same key can follow each other without reconfiguring it.
+ */
+static uint64_t spi_cfg_key(uint32_t mode, uint32_t speed_hz,
+        uint8_t bits_per_word, uint8_t tx_nbits, uint8_t rx_nbits)
+{
+    return speed_hz | (uint64_t) bits_per_word << 32
+            | (uint64_t) (tx_nbits & 0xf) << 40
+            | (uint64_t) (rx_nbits & 0xf) << 44
+            | (uint64_t) (mode & 0xffff) << 48;
+}
+
+static uint64_t spi_xfer_cfg(uint32_t mode, const struct spi_ioc_transfer *xfer)
+{
+    return spi_cfg_key(mode, xfer->speed_hz, xfer->bits_per_word,
+            xfer->tx_nbits, xfer->rx_nbits);
+}
+
+static int spi_futex_wait(volatile uint32_t *addr, uint32_t val, int timeout_ms)
+{
+    struct timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000L,
+    };
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void spi_futex_wake(volatile uint32_t *addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+/* As spi_futex_wait(), until an absolute CLOCK_MONOTONIC time. */
+static int spi_futex_wait_until(volatile uint32_t *addr, uint32_t val,
+        uint64_t when)
+{
+    struct timespec ts = {
+        .tv_sec = when / 1000000000ULL,
+        .tv_nsec = when % 1000000000ULL,
+    };
+    return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET, val, &ts, NULL,
+            FUTEX_BITSET_MATCH_ANY);
+}
+
+static int spi_broker_path(char *path, size_t size, int bus, int device)
+{
+    return snprintf(path, size, "/spipy-%d.%d", bus, device) >= (int)size;
+}
+
+static struct spi_broker *spi_broker_map(const char *path, int flags)
+{
+    struct spi_broker *broker;
+    struct stat st;
+    int fd;
+
+    if ((fd = shm_open(path, flags, 0666)) < 0)
+        return NULL;
+
+    if ((flags & O_CREAT) && ftruncate(fd, sizeof(*broker)) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+    /* a broker that is still starting may not have sized it yet */
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(*broker))
+    {
+        close(fd);
+        errno = ENOENT;
+        return NULL;
+    }
+
+    broker = mmap(NULL, sizeof(*broker), PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    close(fd);
+    return broker == MAP_FAILED ? NULL : broker;
+}
+
+static int spi_pid_alive(pid_t pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+static int spi_broker_alive(struct spi_broker *broker)
+{
+    return spi_pid_alive(broker->pid);
+}
+
+/*
+ * Broker side: free the slots of clients that died holding them, which
+ * would otherwise be lost for good. A slot still being claimed has no
+ * owner yet and is left alone.
+ */
+static void spi_broker_reap(struct spi_broker *broker)
+{
+    unsigned int i;
+    uint32_t state;
+    pid_t owner;
+
+    for (i = 0; i < BROKER_SLOTS; i++)
+    {
+        struct spi_broker_slot *slot = &broker->slot[i];
+
+        state = slot->state;
+        owner = slot->owner;
+        if ((state != SLOT_CLAIMED && state != SLOT_DONE) || owner == 0
+                || spi_pid_alive(owner))
+            continue;
+        if (__sync_bool_compare_and_swap(&slot->owner, owner, 0)
+                && __sync_bool_compare_and_swap(&slot->state, state, SLOT_FREE))
+        {
+            __sync_fetch_and_add(&broker->freed, 1);
+            spi_futex_wake(&broker->freed, 1);
+        }
+    }
+}
+
+/*
+ * Client side: copy the message into a free slot, ring the doorbell and
+ * sleep on the slot until the broker has run it. Called without the GIL.
+ */
+static int spi_broker_submit(struct spi_broker *broker,
+        struct spi_ioc_transfer *xfer, unsigned int n)
+{
+    struct spi_broker_slot *slot = NULL;
+    uint32_t freed, state;
+    unsigned int i, start;
+    size_t off, total = 0;
+    int ret;
+
+    if (n > BROKER_MAX_SEGS)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+        total += xfer[i].len;
+    if (total > BROKER_PAYLOAD)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    while (slot == NULL)
+    {
+        freed = broker->freed;
+        start = __sync_fetch_and_add(&broker->next, 1);
+        for (i = 0; i < BROKER_SLOTS; i++)
+        {
+            struct spi_broker_slot *s = &broker->slot[(start + i) % BROKER_SLOTS];
+            if (__sync_bool_compare_and_swap(&s->state, SLOT_FREE, SLOT_CLAIMED))
+            {
+                slot = s;
+                slot->owner = getpid();
+                break;
+            }
+        }
+        if (slot == NULL)
+        {
+            if (!spi_broker_alive(broker))
+            {
+                errno = EPIPE;
+                return -1;
+            }
+            spi_futex_wait(&broker->freed, freed, BROKER_POLL_MS);
+        }
+    }
+
+    slot->nsegs = n;
+    for (i = 0, off = 0; i < n; i++)
+    {
+        slot->seg[i].len = xfer[i].len;
+        slot->seg[i].speed_hz = xfer[i].speed_hz;
+        slot->seg[i].delay_usecs = xfer[i].delay_usecs;
+        slot->seg[i].bits_per_word = xfer[i].bits_per_word;
+        slot->seg[i].cs_change = xfer[i].cs_change;
+        slot->seg[i].tx_nbits = xfer[i].tx_nbits;
+        slot->seg[i].rx_nbits = xfer[i].rx_nbits;
+        if (xfer[i].tx_buf)
+            memcpy(slot->data + off, (void *)(uintptr_t) xfer[i].tx_buf,
+                    xfer[i].len);
+        else
+            memset(slot->data + off, 0, xfer[i].len);
+        off += xfer[i].len;
+    }
+
+    __sync_synchronize();
+    slot->state = SLOT_SUBMITTED;
+    __sync_fetch_and_add(&broker->doorbell, 1);
+    spi_futex_wake(&broker->doorbell, 1);
+
+    while ((state = slot->state) != SLOT_DONE)
+    {
+        if (spi_futex_wait(&slot->state, state, BROKER_POLL_MS) == -1
+                && errno == ETIMEDOUT && !spi_broker_alive(broker))
+        {
+            /* broker is gone, the slot can never complete */
+            errno = EPIPE;
+            return -1;
+        }
+    }
+    __sync_synchronize();
+
+    ret = slot->result;
+    if (ret < 0)
+        errno = slot->error;
+    for (i = 0, off = 0; i < n; i++)
+    {
+        if (ret >= 0 && xfer[i].rx_buf)
+            memcpy((void *)(uintptr_t) xfer[i].rx_buf, slot->data + off,
+                    xfer[i].len);
+        off += xfer[i].len;
+    }
+
+    slot->owner = 0;
+    __sync_synchronize();
+    slot->state = SLOT_FREE;
+    __sync_fetch_and_add(&broker->freed, 1);
+    spi_futex_wake(&broker->freed, 1);
+    return ret;
+}
+
+static int spi_robust_lock(pthread_mutex_t *mutex)
+{
+    int ret = pthread_mutex_lock(mutex);
+
+    if (ret == EOWNERDEAD)
+        ret = pthread_mutex_consistent(mutex);
+    return ret;
+}
+
+static struct spi_buslock *spi_buslock_attach(int bus, int device)
+{
+    char path[32];
+    struct spi_buslock *lock;
+    pthread_mutexattr_t mattr;
+    struct stat st;
+    int fd, created = 1, tries;
+
+    snprintf(path, sizeof(path), "/spipy-lock-%d.%d", bus, device);
+    if ((fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0666)) < 0)
+    {
+        created = 0;
+        if (errno != EEXIST || (fd = shm_open(path, O_RDWR, 0666)) < 0)
+            return NULL;
+    }
+
+    if (created && ftruncate(fd, sizeof(*lock)) == -1)
+    {
+        close(fd);
+        shm_unlink(path);
+        return NULL;
+    }
+    /* touching it before its creator has sized it would raise SIGBUS */
+    for (tries = 0; !created && tries < 100; tries++)
+    {
+        if (fstat(fd, &st) == -1)
+        {
+            close(fd);
+            return NULL;
+        }
+        if ((size_t) st.st_size >= sizeof(*lock))
+            break;
+        usleep(1000);
+    }
+    if (!created && tries == 100)
+    {
+        close(fd);
+        errno = ETIMEDOUT;
+        return NULL;
+    }
+
+    lock = mmap(NULL, sizeof(*lock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (lock == MAP_FAILED)
+        return NULL;
+
+    if (created)
+    {
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&lock->gate, &mattr);
+        pthread_mutexattr_destroy(&mattr);
+
+        __sync_synchronize();
+        lock->magic = BUSLOCK_MAGIC;
+        return lock;
+    }
+
+    /* someone else is creating it, give them a moment to finish */
+    for (tries = 0; lock->magic != BUSLOCK_MAGIC && tries < 100; tries++)
+        usleep(1000);
+    if (lock->magic != BUSLOCK_MAGIC)
+    {
+        munmap(lock, sizeof(*lock));
+        errno = ETIMEDOUT;
+        return NULL;
+    }
+    return lock;
+}
+
+/* Called with gate held. Forgets waiters whose process has died. */
+static int spi_buslock_outranked(struct spi_buslock *lock, int prio)
+{
+    int i;
+
+    for (i = 0; i < BUSLOCK_MAX_WAITERS; i++)
+    {
+        struct spi_buslock_waiter *w = &lock->waiter[i];
+        if (w->pid != 0 && kill(w->pid, 0) == -1 && errno == ESRCH)
+        {
+            lock->waiting[w->prio]--;
+            w->pid = 0;
+        }
+    }
+    for (i = prio + 1; i < PRIO_CLASSES; i++)
+    {
+        if (lock->waiting[i] > 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Called with gate held. Frees the bus if its holder has died. */
+static int spi_buslock_busy(struct spi_buslock *lock)
+{
+    if (lock->owner == 0)
+        return 0;
+    if (syscall(SYS_tgkill, lock->owner_pid, lock->owner, 0) == -1
+            && errno == ESRCH)
+    {
+        /* the last holder died mid sequence, the bus state is unknown */
+        lock->recovered++;
+        lock->owner = 0;
+        lock->owner_pid = 0;
+        lock->depth = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static int spi_buslock_acquire(struct spi_buslock *lock, int prio)
+{
+    pid_t tid = syscall(SYS_gettid);
+    struct spi_buslock_waiter *me = NULL;
+    uint32_t turn;
+    int i, ret;
+
+    if (lock->owner == tid)
+    {
+        /* nested inside a sequence this thread already holds */
+        lock->depth++;
+        return 0;
+    }
+
+    if ((ret = spi_robust_lock(&lock->gate)) != 0)
+        goto err;
+    for (;;)
+    {
+        /* a full table only means waiting unregistered, never skipping */
+        for (i = 0; i < BUSLOCK_MAX_WAITERS && me == NULL; i++)
+        {
+            if (lock->waiter[i].pid == 0)
+            {
+                me = &lock->waiter[i];
+                me->pid = getpid();
+                me->prio = prio;
+                lock->waiting[prio]++;
+            }
+        }
+        if (!spi_buslock_outranked(lock, prio) && !spi_buslock_busy(lock))
+            break;
+
+        /*
+         * A futex rather than a process shared condvar: a waiter killed
+         * inside pthread_cond_wait() leaves the condvar stuck for everyone.
+         */
+        turn = lock->turn;
+        pthread_mutex_unlock(&lock->gate);
+        spi_futex_wait(&lock->turn, turn, BUSLOCK_POLL_MS);
+        if ((ret = spi_robust_lock(&lock->gate)) != 0)
+            goto err;
+    }
+
+    if (me != NULL)
+    {
+        lock->waiting[prio]--;
+        me->pid = 0;
+    }
+    lock->owner = tid;
+    lock->owner_pid = getpid();
+    lock->depth = 1;
+    pthread_mutex_unlock(&lock->gate);
+    return 0;
+
+err:
+    errno = ret;
+    return -1;
+}
+
+static void spi_buslock_release(struct spi_buslock *lock)
+{
+    if (--lock->depth > 0)
+        return;
+    spi_robust_lock(&lock->gate);
+    lock->owner = 0;
+    lock->owner_pid = 0;
+    lock->turn++;
+    pthread_mutex_unlock(&lock->gate);
+    spi_futex_wake(&lock->turn, INT_MAX);
+}
+
+static void spi_bucket_set(struct spi_bucket *bucket, double rate, double burst)
+{
+    bucket->rate = rate;
+    bucket->burst = burst > 0 ? burst : rate / 10;
+    if (bucket->burst < 1)
+        bucket->burst = 1;
+    bucket->tokens = bucket->burst;
+    bucket->last = spi_now();
+}
+
+/* Returns 0 once cost may be spent, otherwise the ns until it may. */
+static uint64_t spi_bucket_take(struct spi_bucket *bucket, double cost,
+        uint64_t now)
+{
+    double need = cost < bucket->burst ? cost : bucket->burst;
+
+    if (bucket->rate <= 0)
+        return 0;
+
+    bucket->tokens += (now - bucket->last) * bucket->rate / 1e9;
+    if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+    bucket->last = now;
+
+    if (bucket->tokens < need)
+        return (uint64_t) ((need - bucket->tokens) * 1e9 / bucket->rate) + 1;
+
+    bucket->tokens -= cost;
+    return 0;
+}
+
+/* Wait until both the byte and the transfer bucket admit the message. */
+static void SPI_throttle(SPI *self, size_t bytes)
+{
+    uint64_t start = 0, now, wait;
+
+    if (self->byte_bucket.rate <= 0 && self->xfer_bucket.rate <= 0)
+        return;
+
+    for (;;)
+    {
+        now = spi_now();
+        pthread_mutex_lock(&self->lock);
+        wait = spi_bucket_take(&self->xfer_bucket, 1, now);
+        if (wait == 0 && (wait = spi_bucket_take(&self->byte_bucket, bytes, now)) != 0)
+            self->xfer_bucket.tokens += 1; /* give it back, try both again */
+        pthread_mutex_unlock(&self->lock);
+
+        if (wait == 0)
+            break;
+        if (start == 0)
+            start = now;
+        spi_sleep_until(now + wait);
+    }
+
+    if (start != 0)
+    {
+        __sync_fetch_and_add(&self->stats.throttled, 1);
+        __sync_fetch_and_add(&self->stats.throttle_ns, spi_now() - start);
+    }
+}
+
+/*
+ * Would the SPI core accept nbits for a direction of a device in mode?
+ * 0 means single, like 1.
+ */
+static int spi_nbits_ok(uint32_t mode, uint8_t nbits, uint32_t dual,
+        uint32_t quad)
+{
+    switch (nbits)
+    {
+    case 0:
+    case 1:
+        return 1;
+    case 2:
+        return (mode & (dual | quad)) != 0;
+    case 4:
+        return (mode & quad) != 0;
+    default:
+        return 0;
+    }
+}
+
+/* splitmix64, uniform in [0, 1) */
+static double spi_fault_draw(struct spi_faults *f)
+{
+    uint64_t z = (f->rng += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Decide this message's faults before it runs. Returns the errno to fail
+ * it with, or 0, and sets *delay_ns and *busy.
+ */
+static int spi_fault_plan(struct spi_faults *f, uint64_t *delay_ns, int *busy)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&f->lock);
+    *delay_ns = 0;
+    if (f->latency_rate > 0 && spi_fault_draw(f) < f->latency_rate)
+    {
+        *delay_ns = f->latency_ns;
+        f->delays++;
+    }
+    if (f->error_rate > 0 && spi_fault_draw(f) < f->error_rate)
+    {
+        err = f->errnos[(unsigned int) (spi_fault_draw(f) * f->nerrnos)];
+        f->errors++;
+    }
+    if (f->busy_left == 0 && f->busy_rate > 0 && spi_fault_draw(f) < f->busy_rate)
+        f->busy_left = f->busy_messages;
+    *busy = f->busy_left > 0;
+    if (*busy && err == 0)
+    {
+        f->busy_left--;
+        f->busy++;
+    }
+    pthread_mutex_unlock(&f->lock);
+    return err;
+}
+
+static void spi_fault_corrupt(struct spi_faults *f, struct spi_ioc_transfer *xfer,
+        unsigned int n, int busy)
+{
+    unsigned char *rx;
+    unsigned int i;
+    size_t j;
+
+    pthread_mutex_lock(&f->lock);
+    for (i = 0; i < n; i++)
+    {
+        if (!xfer[i].rx_buf || xfer[i].len == 0)
+            continue;
+        rx = (unsigned char *)(uintptr_t) xfer[i].rx_buf;
+        if (busy)
+            rx[0] |= f->busy_mask;
+        if (f->flip_rate > 0)
+            for (j = 0; j < xfer[i].len; j++)
+                if (spi_fault_draw(f) < f->flip_rate)
+                {
+                    rx[j] ^= 1 << (unsigned int) (spi_fault_draw(f) * 8);
+                    f->flips++;
+                }
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * The emulated device has MOSI wired to MISO: every byte sent comes
+ * straight back. It needs no hardware, which makes it useful for
+ * measuring spipy's own overhead.
+ *
+ * The mock checks bus widths the way the SPI core does, so code using
+ * dual and quad transfers can be tried out with set_mode().
+ */
+static int spi_mock_message(SPI *self, struct spi_ioc_transfer *xfer,
+        unsigned int n)
+{
+    struct spi_faults *faults = self->faults;
+    uint64_t delay_ns = 0;
+    unsigned int i;
+    int ret = 0, err = 0, busy = 0;
+
+    for (i = 0; i < n; i++)
+        if ((xfer[i].tx_buf && !spi_nbits_ok(self->mode, xfer[i].tx_nbits,
+                        SPI_TX_DUAL, SPI_TX_QUAD))
+                || (xfer[i].rx_buf && !spi_nbits_ok(self->mode,
+                        xfer[i].rx_nbits, SPI_RX_DUAL, SPI_RX_QUAD)))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+    if (faults != NULL)
+    {
+        err = spi_fault_plan(faults, &delay_ns, &busy);
+        if (delay_ns > 0)
+            spi_sleep_until(spi_now() + delay_ns);
+        if (err != 0)
+        {
+            errno = err;
+            return -1;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (xfer[i].rx_buf && xfer[i].tx_buf)
+            memmove((void *)(uintptr_t) xfer[i].rx_buf,
+                    (void *)(uintptr_t) xfer[i].tx_buf, xfer[i].len);
+        else if (xfer[i].rx_buf)
+            memset((void *)(uintptr_t) xfer[i].rx_buf, 0, xfer[i].len);
+        ret += xfer[i].len;
+    }
+
+    if (faults != NULL && (busy || faults->flip_rate > 0))
+        spi_fault_corrupt(faults, xfer, n, busy);
+    return ret;
+}
+
+static void spi_faults_free(struct spi_faults *faults)
+{
+    if (faults == NULL)
+        return;
+    pthread_mutex_destroy(&faults->lock);
+    free(faults);
+}
+
+/*
+ * Broker side: run one submitted slot against the device, or the mock
+ * for serve(mock=True). The slot is writable by every client, so each
+ * field is read once and checked before the broker points the driver
+ * at it.
+ */
+static void spi_broker_run(SPI *dev, struct spi_broker_slot *slot)
+{
+    struct spi_ioc_transfer xfer[BROKER_MAX_SEGS];
+    unsigned int i, n = slot->nsegs;
+    size_t off = 0;
+
+    __sync_synchronize();
+    memset(xfer, 0, sizeof(xfer));
+    for (i = 0; i < n && i < BROKER_MAX_SEGS; i++)
+    {
+        xfer[i].len = slot->seg[i].len;
+        if (xfer[i].len > BROKER_PAYLOAD - off)
+            break;
+        xfer[i].tx_buf = (unsigned long) (slot->data + off);
+        xfer[i].rx_buf = (unsigned long) (slot->data + off);
+        xfer[i].speed_hz = slot->seg[i].speed_hz;
+        xfer[i].delay_usecs = slot->seg[i].delay_usecs;
+        xfer[i].bits_per_word = slot->seg[i].bits_per_word;
+        xfer[i].cs_change = slot->seg[i].cs_change;
+        xfer[i].tx_nbits = slot->seg[i].tx_nbits;
+        xfer[i].rx_nbits = slot->seg[i].rx_nbits;
+        off += xfer[i].len;
+    }
+
+    if (i < n)
+    {
+        slot->result = -1;
+        slot->error = EMSGSIZE;
+    }
+    else
+    {
+        slot->result = dev->mock ? spi_mock_message(dev, xfer, i)
+                : ioctl(dev->fd, SPI_IOC_MESSAGE(i), xfer);
+        slot->error = slot->result < 0 ? errno : 0;
+    }
+    __sync_synchronize();
+    slot->state = SLOT_DONE;
+    spi_futex_wake(&slot->state, 1);
+}
+
+static void spi_trace_record(int bus, int device, uint64_t start,
+        uint64_t end, size_t bytes, unsigned int n, int ret)
+{
+    uint64_t seq = __sync_fetch_and_add(&spi_trace.head, 1);
+    struct spi_trace_rec *rec = &spi_trace.rec[seq & spi_trace.mask];
+
+    if (spi_tid == 0)
+        spi_tid = syscall(SYS_gettid);
+
+    rec->seq = 0;
+    __sync_synchronize();
+    rec->start = start;
+    rec->end = end;
+    rec->bytes = bytes;
+    rec->segments = n;
+    rec->bus = bus;
+    rec->device = device;
+    rec->tid = spi_tid;
+    rec->result = ret < 0 ? -errno : ret;
+    __sync_synchronize();
+    rec->seq = seq + 1;
+}
+
+/* Account a successful message to its bus's second of start. */
+static void spi_util_record(SPI *self, struct spi_ioc_transfer *xfer,
+        unsigned int n, uint64_t start, uint64_t end, size_t bytes)
+{
+    struct spi_util *util = &spi_util[self->bus];
+    struct spi_util_sec *sec;
+    uint64_t wire_ns = 0, gap, cfg;
+    uint32_t speed, width;
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+    {
+        speed = xfer[i].speed_hz ? xfer[i].speed_hz : self->msh;
+        /* dual and quad segments move 2 or 4 bits a clock */
+        width = xfer[i].tx_buf ? xfer[i].tx_nbits : xfer[i].rx_nbits;
+        if (width == 0)
+            width = 1;
+        if (speed != 0)
+            wire_ns += (uint64_t) xfer[i].len
+                    * (xfer[i].bits_per_word ? xfer[i].bits_per_word : 8)
+                    * 1000000000ULL / speed / width;
+    }
+
+    pthread_mutex_lock(&util->lock);
+    sec = &util->sec[(start / 1000000000ULL) % UTIL_SECONDS];
+    if (sec->sec != start / 1000000000ULL)
+    {
+        memset(sec, 0, sizeof(*sec));
+        sec->sec = start / 1000000000ULL;
+    }
+    if (util->first == 0)
+        util->first = start;
+    else if (start > util->last_end)
+    {
+        gap = start - util->last_end;
+        sec->gaps++;
+        sec->gap_ns += gap;
+        if (gap > sec->max_gap_ns)
+            sec->max_gap_ns = gap;
+    }
+    if (end > util->last_end)
+        util->last_end = end;
+    for (i = 0; i < n; i++)
+    {
+        cfg = spi_xfer_cfg(self->mode, &xfer[i]);
+        if (cfg != util->last_cfg && util->last_cfg != 0)
+            sec->reconfigs++;
+        util->last_cfg = cfg;
+    }
+    sec->messages++;
+    sec->bytes += bytes;
+    sec->busy_ns += end - start;
+    sec->wire_ns += wire_ns;
+    pthread_mutex_unlock(&util->lock);
+}
+
+/*
+ * Copy the counters out after a message. A segment belongs to one handle,
+ * and threads sending on it take turns under self->lock, so the seqlock
+ * has a single writer and seq is only ever bumped by the one inside.
+ */
+static void spi_pub_update(SPI *self, uint64_t io_ns)
+{
+    struct spi_pubstats *pub;
+    uint64_t usec = io_ns / 1000;
+    unsigned int bucket = 0;
+    uint32_t seq;
+
+    while (usec > 0 && bucket < PUB_LAT_BUCKETS - 1)
+    {
+        usec >>= 1;
+        bucket++;
+    }
+
+    pthread_mutex_lock(&self->lock);
+    if ((pub = self->pub) == NULL)
+    {
+        pthread_mutex_unlock(&self->lock);
+        return;
+    }
+    seq = pub->seq;
+    pub->seq = seq + 1;
+    __sync_synchronize();
+    pub->transfers = self->stats.transfers;
+    pub->segments = self->stats.segments;
+    pub->bytes = self->stats.bytes;
+    pub->errors = self->stats.errors;
+    pub->throttled = self->stats.throttled;
+    pub->throttle_ns = self->stats.throttle_ns;
+    pub->io_ns = self->stats.io_ns;
+    pub->latency[bucket]++;
+    __sync_synchronize();
+    pub->seq = seq + 2;
+    pthread_mutex_unlock(&self->lock);
+}
+
+/* Send one message on the bus, with the GIL released. */
+static int SPI_send(SPI *self, struct spi_ioc_transfer *xfer, unsigned int n)
+{
+    size_t bytes = 0;
+    uint64_t start, end;
+    unsigned int i;
+    int ret, err;
+
+    for (i = 0; i < n; i++)
+        bytes += xfer[i].len;
+    SPI_PROBE(message_submit, self, bytes, n);
+    SPI_throttle(self, bytes);
+
+    if (self->buslock != NULL && spi_buslock_acquire(self->buslock, self->prio) < 0)
+        return -1;
+
+    if (self->trace_fd != -1)
+        (void) !write(self->trace_fd, self->trace_begin, self->trace_begin_len);
+    start = spi_now();
+    if (self->broker != NULL)
+        ret = spi_broker_submit(self->broker, xfer, n);
+    else if (self->mock)
+        ret = spi_mock_message(self, xfer, n);
+    else
+        ret = ioctl(self->fd, SPI_IOC_MESSAGE(n), xfer);
+    end = spi_now();
+    __sync_fetch_and_add(&self->stats.io_ns, end - start);
+    SPI_PROBE_RET(ioctl_return, self, bytes, n, ret);
+    if (spi_trace.enabled)
+        spi_trace_record(self->bus, self->device, start, end, bytes, n, ret);
+    if (self->trace_fd != -1)
+    {
+        err = errno;
+        (void) !write(self->trace_fd, self->trace_end, self->trace_end_len);
+        errno = err;
+    }
+
+    if (self->buslock != NULL)
+    {
+        err = errno;
+        spi_buslock_release(self->buslock);
+        errno = err;
+    }
+
+    if (ret < 0)
+    {
+        __sync_fetch_and_add(&self->stats.errors, 1);
+        if (self->pub != NULL)
+        {
+            err = errno;
+            spi_pub_update(self, end - start);
+            errno = err;
+        }
+        return ret;
+    }
+    /* mock traffic never touches the bus it is named after */
+    if (!self->mock && self->bus >= 0 && self->bus < UTIL_BUSES)
+        spi_util_record(self, xfer, n, start, end, bytes);
+    __sync_fetch_and_add(&self->stats.transfers, 1);
+    __sync_fetch_and_add(&self->stats.segments, n);
+    __sync_fetch_and_add(&self->stats.bytes, bytes);
+    if (self->pub != NULL)
+        spi_pub_update(self, end - start);
+    return ret;
+}
+
+/* Called by the thread holding combiner->lock. */
+static void spi_combine_run(SPI *self, struct spi_combiner *combiner)
+{
+    struct spi_ioc_transfer xfer[COMBINE_MAX_SEGS];
+    struct spi_comb_slot *batch[COMBINE_SLOTS];
+    unsigned int i, j, n = 0, count = 0, max_segs;
+    size_t bytes = 0, len, max_bytes = spi_bufsiz();
+    uint64_t cfg = 0;
+    int ret, err;
+
+    max_segs = self->broker != NULL ? BROKER_MAX_SEGS : COMBINE_MAX_SEGS;
+    if (self->broker != NULL && max_bytes > BROKER_PAYLOAD)
+        max_bytes = BROKER_PAYLOAD;
+
+    for (i = 0; i < COMBINE_SLOTS; i++)
+    {
+        struct spi_comb_slot *slot = &combiner->slot[i];
+        if (slot->state != SLOT_SUBMITTED)
+            continue;
+
+        for (j = 0, len = 0; j < slot->n; j++)
+            len += slot->xfer[j].len;
+        /* always take the first, it may be too big to share anyway */
+        if (count > 0 && (n + slot->n > max_segs || bytes + len > max_bytes))
+            continue;
+        /* only share with messages needing the same controller setup */
+        if (count > 0 && slot->n > 0 && spi_xfer_cfg(0, slot->xfer) != cfg)
+            continue;
+        if (slot->n > COMBINE_MAX_SEGS)
+        {
+            slot->result = -1;
+            slot->error = EMSGSIZE;
+            slot->state = SLOT_DONE;
+            spi_futex_wake(&slot->state, 1);
+            continue;
+        }
+
+        SPI_PROBE(combine_dequeue, self, len, slot->n);
+        if (count == 0 && slot->n > 0)
+            cfg = spi_xfer_cfg(0, slot->xfer);
+        memcpy(&xfer[n], slot->xfer, slot->n * sizeof(*xfer));
+        n += slot->n;
+        bytes += len;
+        if (count > 0)
+            xfer[n - slot->n - 1].cs_change = 1; /* end of previous message */
+        batch[count++] = slot;
+    }
+
+    if (count == 0)
+        return;
+
+    ret = SPI_send(self, xfer, n);
+    err = errno;
+
+    for (i = 0; i < count; i++)
+    {
+        struct spi_comb_slot *slot = batch[i];
+        for (j = 0, len = 0; j < slot->n; j++)
+            len += slot->xfer[j].len;
+        slot->result = ret < 0 ? -1 : (int) len;
+        slot->error = err;
+        __sync_synchronize();
+        slot->state = SLOT_DONE;
+        spi_futex_wake(&slot->state, 1);
+    }
+}
+
+static int spi_combine_submit(SPI *self, struct spi_combiner *combiner,
+        struct spi_ioc_transfer *xfer, unsigned int n)
+{
+    struct spi_comb_slot *slot = NULL;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < COMBINE_SLOTS && slot == NULL; i++)
+        if (__sync_bool_compare_and_swap(&combiner->slot[i].state,
+                SLOT_FREE, SLOT_CLAIMED))
+            slot = &combiner->slot[i];
+
+    if (slot == NULL)
+    {
+        /* more threads than slots, just wait for the bus */
+        pthread_mutex_lock(&combiner->lock);
+        ret = SPI_send(self, xfer, n);
+        pthread_mutex_unlock(&combiner->lock);
+        return ret;
+    }
+
+    slot->xfer = xfer;
+    slot->n = n;
+    SPI_PROBE(combine_enqueue, self, xfer[0].len, n);
+    __sync_synchronize();
+    slot->state = SLOT_SUBMITTED;
+
+    while (slot->state != SLOT_DONE)
+    {
+        if (pthread_mutex_trylock(&combiner->lock) == 0)
+        {
+            spi_combine_run(self, combiner);
+            pthread_mutex_unlock(&combiner->lock);
+        }
+        else
+        {
+            spi_futex_wait(&slot->state, SLOT_SUBMITTED, COMBINE_POLL_MS);
+        }
+    }
+    __sync_synchronize();
+
+    ret = slot->result;
+    if (ret < 0)
+        errno = slot->error;
+    slot->state = SLOT_FREE;
+    return ret;
+}
+
+/*
+ * Every message goes through here, with the GIL released. Returns the
+ * ioctl result, or -1 with errno set.
+ */
+static int SPI_message(SPI *self, struct spi_ioc_transfer *xfer, unsigned int n)
+{
+    /*
+     * A thread holding the bus lock sends directly: a combiner run by
+     * another thread would wait on the lock for a message stuck in its
+     * own batch.
+     */
+    if (self->combining && (self->buslock == NULL
+            || self->buslock->owner != syscall(SYS_gettid)))
+        return spi_combine_submit(self, self->combiner, xfer, n);
+
+    return SPI_send(self, xfer, n);
+}
+
+static PyObject *
+SPI_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    SPI *self;
+    if ((self = (SPI *) type->tp_alloc(type, 0)) == NULL)
+        return NULL;
+
+    self->fd = -1;
+    self->mode = 0;
+    self->bpw = 0;
+    self->msh = 0;
+    self->bus = -1;
+    self->device = -1;
+    self->broker = NULL;
+    self->buslock = NULL;
+    self->prio = PRIO_NORMAL;
+    self->sched = NULL;
+    pthread_mutex_init(&self->lock, NULL);
+    memset(&self->byte_bucket, 0, sizeof(self->byte_bucket));
+    memset(&self->xfer_bucket, 0, sizeof(self->xfer_bucket));
+    memset(&self->stats, 0, sizeof(self->stats));
+    self->combiner = NULL;
+    self->combining = 0;
+    self->batch = NULL;
+    self->mock = 0;
+    self->faults = NULL;
+    self->ring_size = 0;
+    self->ring_next = 0;
+    self->ring_buf = NULL;
+    self->ring_view = NULL;
+    self->speed = TRANSFER_SPEED_HZ;
+    self->tune = NULL;
+    self->seg_size = 0;
+    self->batch_depth = 0;
+    self->kstats = NULL;
+    self->trace_fd = -1;
+    self->pub = NULL;
+    self->sampler = NULL;
+    self->users[0] = 0;
+    self->users[1] = 0;
+    self->epoch = 0;
+    self->closing = 0;
+    self->swapping = 0;
+
+    return (PyObject *) self;
+}
+
+/* Called with batch->lock held and the GIL released. */
+static int spi_batch_flush_locked(SPI *self, struct spi_batch *batch)
+{
+    unsigned int i;
+    int ret = 0;
+
+    if (batch->count == 0)
+        return 0;
+
+    for (i = 0; i + 1 < batch->count; i++)
+        batch->xfer[i].cs_change = 1;
+    SPI_PROBE(batch_dequeue, self, batch->used, batch->count);
+    ret = SPI_message(self, batch->xfer, batch->count);
+    batch->count = 0;
+    batch->used = 0;
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Nobody waits for the bus lock while holding batch->lock: its holder
+ * may need batch->lock to flush. A thread that is about to send from the
+ * batch without owning the bus lock takes the bus lock first, counted in
+ * lockers meanwhile so the flusher stays out of the way.
+ */
+static int spi_batch_buslock(SPI *self, struct spi_batch *batch, int prio)
+{
+    int ret;
+
+    pthread_mutex_lock(&batch->lock);
+    batch->lockers++;
+    pthread_mutex_unlock(&batch->lock);
+
+    ret = spi_buslock_acquire(self->buslock, prio);
+
+    pthread_mutex_lock(&batch->lock);
+    batch->lockers--;
+    pthread_mutex_unlock(&batch->lock);
+    return ret;
+}
+
+/* Whether sending needs spi_batch_buslock() first. */
+static int spi_batch_needs_bus(SPI *self)
+{
+    return self->buslock != NULL
+            && self->buslock->owner != syscall(SYS_gettid);
+}
+
+/*
+ * Whether a thread of this process holds or waits for the bus lock. It
+ * may be waiting for batch->lock to flush, so the flusher, which holds
+ * batch->lock while it sends, must not block on the bus lock. Called
+ * with batch->lock held.
+ */
+static int spi_batch_deferred(SPI *self, struct spi_batch *batch)
+{
+    struct spi_buslock *lock = self->buslock;
+
+    return lock != NULL && (batch->lockers > 0
+            || (lock->owner != 0 && lock->owner_pid == getpid()));
+}
+
+/*
+ * Send whatever write() has queued, reporting a failed background flush
+ * if there was one. Called with the GIL released.
+ */
+static int spi_batch_flush(SPI *self, struct spi_batch *batch)
+{
+    int ret, bus = 0;
+
+    if (batch == NULL)
+        return 0;
+
+    pthread_mutex_lock(&batch->lock);
+    if (batch->count > 0 && spi_batch_needs_bus(self))
+    {
+        pthread_mutex_unlock(&batch->lock);
+        if (spi_batch_buslock(self, batch, self->prio) < 0)
+            return -1;
+        bus = 1;
+        pthread_mutex_lock(&batch->lock);
+    }
+    ret = spi_batch_flush_locked(self, batch);
+    if (ret == 0 && batch->error != 0)
+    {
+        errno = batch->error;
+        ret = -1;
+    }
+    batch->error = 0;
+    pthread_mutex_unlock(&batch->lock);
+    if (bus)
+        spi_buslock_release(self->buslock);
+    return ret;
+}
+
+static int SPI_flush(SPI *self)
+{
+    if (SPI_closed(self))
+        return -1;
+    return spi_batch_flush(self, self->batch);
+}
+
+static void *spi_batch_flusher(void *arg)
+{
+    struct spi_batch *batch = arg;
+    SPI *self = batch->owner;
+    struct timespec ts;
+    uint64_t due;
+
+    pthread_mutex_lock(&batch->lock);
+    while (!batch->stop)
+    {
+        if (batch->count == 0)
+        {
+            pthread_cond_wait(&batch->wake, &batch->lock);
+            continue;
+        }
+
+        due = batch->first + batch->window_ns;
+        if (spi_batch_deferred(self, batch))
+            due = spi_now() + batch->window_ns;
+        if (spi_now() < due)
+        {
+            ts.tv_sec = due / 1000000000ULL;
+            ts.tv_nsec = due % 1000000000ULL;
+            pthread_cond_timedwait(&batch->wake, &batch->lock, &ts);
+            continue;
+        }
+
+        if (spi_batch_flush_locked(self, batch) < 0 && batch->error == 0)
+            batch->error = errno;
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+/*
+ * Make a batch and start its flusher; the caller installs it as
+ * self->batch. Returns NULL with errno set on failure.
+ */
+static struct spi_batch *spi_batch_start(SPI *self, unsigned int max_entries,
+        uint64_t window_ns)
+{
+    struct spi_batch *batch;
+    pthread_condattr_t cattr;
+
+    if ((batch = calloc(1, sizeof(*batch))) == NULL)
+        return NULL;
+    batch->size = spi_bufsiz();
+    /* a batch goes out as one message, which must fit a broker slot */
+    if (self->broker != NULL)
+    {
+        if (batch->size > BROKER_PAYLOAD)
+            batch->size = BROKER_PAYLOAD;
+        if (max_entries > BROKER_MAX_SEGS)
+            max_entries = BROKER_MAX_SEGS;
+    }
+    batch->alloc = batch->size;
+    if ((batch->data = spi_arena_alloc(&batch->alloc, 0)) == NULL)
+    {
+        free(batch);
+        return NULL;
+    }
+    batch->max_entries = max_entries;
+    batch->window_ns = window_ns;
+    batch->owner = self;
+
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&batch->wake, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    if ((errno = pthread_create(&batch->flusher, NULL, spi_batch_flusher, batch)) != 0)
+    {
+        pthread_cond_destroy(&batch->wake);
+        pthread_mutex_destroy(&batch->lock);
+        spi_arena_free(batch->data, batch->alloc);
+        free(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+/*
+ * Flush and free a batch already taken out of self->batch, once no
+ * other thread can still be using it. Called with the GIL released.
+ */
+static int spi_batch_stop(SPI *self, struct spi_batch *batch)
+{
+    int ret;
+
+    if (batch == NULL)
+        return 0;
+
+    ret = spi_batch_flush(self, batch);
+
+    pthread_mutex_lock(&batch->lock);
+    batch->stop = 1;
+    pthread_cond_signal(&batch->wake);
+    pthread_mutex_unlock(&batch->lock);
+    pthread_join(batch->flusher, NULL);
+
+    pthread_cond_destroy(&batch->wake);
+    pthread_mutex_destroy(&batch->lock);
+    spi_arena_free(batch->data, batch->alloc);
+    free(batch);
+    return ret;
+}
+
+/* Queue, or send right away, a write-only transfer. GIL released. */
+static int SPI_write_buf(SPI *self, const unsigned char *buf, size_t len)
+{
+    struct spi_batch *batch;
+    struct spi_ioc_transfer xfer;
+    int ret = 0, bus = 0;
+
+    if (SPI_closed(self))
+        return -1;
+    batch = self->batch;
+
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.len = len;
+    xfer.delay_usecs = TRANSFER_DELAY_USECS;
+    xfer.speed_hz = self->speed;
+    xfer.bits_per_word = TRANSFER_BITS;
+
+    if (batch == NULL || len > batch->size)
+    {
+        if (SPI_flush(self) < 0)
+            return -1;
+        xfer.tx_buf = (unsigned long) buf;
+        return SPI_message(self, &xfer, 1) < 0 ? -1 : 0;
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    if ((batch->used + len > batch->size || batch->count + 1 >= batch->max_entries)
+            && spi_batch_needs_bus(self))
+    {
+        /* this write sends the batch */
+        pthread_mutex_unlock(&batch->lock);
+        if (spi_batch_buslock(self, batch, self->prio) < 0)
+            return -1;
+        bus = 1;
+        pthread_mutex_lock(&batch->lock);
+    }
+    if (batch->used + len > batch->size)
+        ret = spi_batch_flush_locked(self, batch);
+
+    if (ret == 0)
+    {
+        memcpy(batch->data + batch->used, buf, len);
+        xfer.tx_buf = (unsigned long) (batch->data + batch->used);
+        batch->xfer[batch->count++] = xfer;
+        batch->used += len;
+        SPI_PROBE(batch_enqueue, self, len, batch->count);
+
+        if (batch->count >= batch->max_entries)
+        {
+            ret = spi_batch_flush_locked(self, batch);
+        }
+        else if (batch->count == 1)
+        {
+            batch->first = spi_now();
+            pthread_cond_signal(&batch->wake);
+        }
+    }
+    pthread_mutex_unlock(&batch->lock);
+    if (bus)
+        spi_buslock_release(self->buslock);
+    return ret;
+}
+
+/*
+ * Compare len bytes of rx against expected under mask (all ones when
+ * NULL), appending the offsets of differing bytes, base-relative, to
+ * offsets while there is room. Blocks of 64 bytes are XORed a word at a
+ * time with no branches, which the compiler vectorizes, and only blocks
+ * with a difference are looked at byte by byte.
+ */
+static size_t spi_verify_block(const unsigned char *rx,
+        const unsigned char *expected, const unsigned char *mask, size_t len,
+        size_t base, size_t *offsets, size_t *noffsets, size_t max_offsets)
+{
+    size_t i, j, mismatches = 0;
+    uint64_t a, b, m, acc;
+
+    for (i = 0; i < len; i += 64)
+    {
+        size_t block = len - i < 64 ? len - i : 64;
+
+        if (block == 64)
+        {
+            acc = 0;
+            for (j = 0; j < 64; j += 8)
+            {
+                memcpy(&a, rx + i + j, 8);
+                memcpy(&b, expected + i + j, 8);
+                m = ~(uint64_t) 0;
+                if (mask != NULL)
+                    memcpy(&m, mask + i + j, 8);
+                acc |= (a ^ b) & m;
+            }
+            if (acc == 0)
+                continue;
+        }
+
+        for (j = i; j < i + block; j++)
+        {
+            if (((rx[j] ^ expected[j]) & (mask ? mask[j] : 0xff)) == 0)
+                continue;
+            mismatches++;
+            if (*noffsets < max_offsets)
+                offsets[(*noffsets)++] = base + j;
+        }
+    }
+    return mismatches;
+}
+
+/* Does the probe come back as expected at speed, trials times over? */
+static int spi_tune_check(SPI *self, struct spi_tune *tune, uint32_t speed)
+{
+    struct spi_ioc_transfer xfer;
+    int i;
+
+    for (i = 0; i < tune->trials; i++)
+    {
+        memset(&xfer, 0, sizeof(xfer));
+        xfer.tx_buf = (unsigned long) tune->probe;
+        xfer.rx_buf = (unsigned long) tune->rx;
+        xfer.len = tune->len;
+        xfer.delay_usecs = TRANSFER_DELAY_USECS;
+        xfer.speed_hz = speed;
+        xfer.bits_per_word = TRANSFER_BITS;
+        if (SPI_message(self, &xfer, 1) < 0)
+            return -1;
+        if (memcmp(tune->rx, tune->expected, tune->len) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Binary search the fastest speed in [min_hz, hi] at which every trial
+ * passes, assuming anything slower than a passing speed passes too, and
+ * set the handle's speed to margin of it. Returns the fastest passing
+ * speed, 0 if even min_hz fails, or -1 with errno set.
+ */
+static long spi_tune_search(SPI *self, struct spi_tune *tune, uint32_t hi)
+{
+    uint32_t lo = tune->min_hz, mid;
+    int ret;
+
+    if ((ret = spi_tune_check(self, tune, lo)) <= 0)
+        return ret;
+    if ((ret = spi_tune_check(self, tune, hi)) < 0)
+        return -1;
+
+    while (!ret && hi - lo > lo / TUNE_RESOLUTION)
+    {
+        mid = lo + (hi - lo) / 2;
+        if ((ret = spi_tune_check(self, tune, mid)) < 0)
+            return -1;
+        if (ret)
+            lo = mid;
+        else
+            hi = mid;
+        ret = 0;
+    }
+    if (ret)
+        lo = hi;
+
+    tune->limit_hz = lo;
+    tune->last = spi_now();
+    self->speed = lo * tune->margin;
+    if (self->speed < tune->min_hz)
+        self->speed = tune->min_hz;
+    return lo;
+}
+
+/*
+ * If re-verification is due, check the tuned speed still works and
+ * search the whole range again if not. Fails with EIO when nothing
+ * passes, leaving the check due so the next message retries. When
+ * another thread is already re-verifying, the message goes ahead at the
+ * current speed rather than wait for it. Called without the GIL.
+ */
+static int SPI_tune_refresh(SPI *self)
+{
+    struct spi_tune *tune = self->tune;
+    long found;
+    int ret = 0;
+
+    if (tune == NULL || tune->interval_ns == 0
+            || spi_now() - tune->last < tune->interval_ns)
+        return 0;
+    if (pthread_mutex_trylock(&tune->lock) != 0)
+        return 0;
+
+    /* the thread that held the lock may have just done it */
+    if (spi_now() - tune->last < tune->interval_ns)
+        goto out;
+
+    if ((ret = spi_tune_check(self, tune, self->speed)) < 0)
+        goto out;
+    if (ret)
+    {
+        tune->last = spi_now();
+        ret = 0;
+        goto out;
+    }
+
+    tune->retunes++;
+    if ((found = spi_tune_search(self, tune, tune->max_hz)) < 0)
+        ret = -1;
+    else if (found == 0)
+    {
+        errno = EIO;
+        ret = -1;
+    }
+
+out:
+    pthread_mutex_unlock(&tune->lock);
+    return ret;
+}
+
+static void spi_tune_free(struct spi_tune *tune)
+{
+    if (tune == NULL)
+        return;
+    pthread_mutex_destroy(&tune->lock);
+    spi_arena_free(tune->probe, tune->alloc);
+    free(tune);
+}
+
+static const char *const spi_kstat_names[KSTAT_COUNTERS] = {
+    "messages", "transfers", "errors", "timedout", "spi_sync",
+    "spi_sync_immediate", "spi_async", "bytes", "bytes_rx", "bytes_tx",
+    "transfers_split_maxsize",
+};
+
+static void spi_kstats_free(struct spi_kstats *ks)
+{
+    int d, i;
+
+    if (ks == NULL)
+        return;
+    for (d = 0; d < 2; d++)
+        for (i = 0; i < KSTAT_FILES; i++)
+            if (ks->fd[d][i] != -1)
+                close(ks->fd[d][i]);
+    free(ks);
+}
+
+/* Returns NULL with errno set when neither directory has any counters. */
+static struct spi_kstats *spi_kstats_open(int bus, int device)
+{
+    struct spi_kstats *ks;
+    char path[PATH_MAX];
+    int d, i, len, found = 0;
+
+    if ((ks = calloc(1, sizeof(*ks))) == NULL)
+        return NULL;
+
+    for (d = 0; d < 2; d++)
+    {
+        if (d == 0)
+            len = snprintf(path, sizeof(path), SPI_MASTER_STATS, bus);
+        else
+            len = snprintf(path, sizeof(path), SPI_DEVICE_STATS, bus, device);
+
+        for (i = 0; i < KSTAT_FILES; i++)
+        {
+            if (i < KSTAT_COUNTERS)
+                snprintf(path + len, sizeof(path) - len, "%s", spi_kstat_names[i]);
+            else if (i < KSTAT_FILES - 1)
+                snprintf(path + len, sizeof(path) - len,
+                        "transfer_bytes_histo_%u-%u",
+                        i == KSTAT_COUNTERS ? 0 : 1u << (i - KSTAT_COUNTERS),
+                        (2u << (i - KSTAT_COUNTERS)) - 1);
+            else
+                snprintf(path + len, sizeof(path) - len,
+                        "transfer_bytes_histo_%u+", 1u << (i - KSTAT_COUNTERS));
+            ks->fd[d][i] = open(path, O_RDONLY | O_CLOEXEC);
+            if (ks->fd[d][i] != -1)
+                found++;
+        }
+    }
+
+    if (found == 0)
+    {
+        spi_kstats_free(ks);
+        errno = ENOENT;
+        return NULL;
+    }
+    return ks;
+}
+
+/* Read every open counter into value; missing ones read as zero. */
+static void spi_kstats_read(struct spi_kstats *ks, uint64_t value[2][KSTAT_FILES])
+{
+    char buf[32];
+    ssize_t len;
+    int d, i;
+
+    for (d = 0; d < 2; d++)
+        for (i = 0; i < KSTAT_FILES; i++)
+        {
+            value[d][i] = 0;
+            if (ks->fd[d][i] == -1)
+                continue;
+            len = pread(ks->fd[d][i], buf, sizeof(buf) - 1, 0);
+            if (len <= 0)
+                continue;
+            buf[len] = '\0';
+            value[d][i] = strtoull(buf, NULL, 10);
+        }
+}
+
+static int spi_pipe_init(struct spi_pipe *pipe, size_t size)
+{
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->size = ALIGN_UP(size, sysconf(_SC_PAGESIZE));
+    pipe->alloc = 2 * pipe->size;
+    if ((pipe->buf[0] = spi_arena_alloc(&pipe->alloc, 0)) == NULL)
+        return -1;
+    pipe->buf[1] = pipe->buf[0] + pipe->size;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+    return 0;
+}
+
+static void spi_pipe_destroy(struct spi_pipe *pipe)
+{
+    pthread_cond_destroy(&pipe->cond);
+    pthread_mutex_destroy(&pipe->lock);
+    spi_arena_free(pipe->buf[0], pipe->alloc);
+}
+
+static void spi_pipe_fail(struct spi_pipe *pipe, int error)
+{
+    pthread_mutex_lock(&pipe->lock);
+    if (pipe->error == 0)
+        pipe->error = error;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+/* Producer: wait for buffer i to be empty. NULL once the pipe failed. */
+static unsigned char *spi_pipe_get_empty(struct spi_pipe *pipe, int i)
+{
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->full[i] && !pipe->error)
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+    pthread_mutex_unlock(&pipe->lock);
+    return pipe->error ? NULL : pipe->buf[i];
+}
+
+static void spi_pipe_put(struct spi_pipe *pipe, int i, size_t len)
+{
+    pthread_mutex_lock(&pipe->lock);
+    pipe->len[i] = len;
+    pipe->full[i] = 1;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+static void spi_pipe_eof(struct spi_pipe *pipe)
+{
+    pthread_mutex_lock(&pipe->lock);
+    pipe->eof = 1;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+/*
+ * Consumer: wait for buffer i to be filled. NULL once the producer has
+ * finished and nothing is left, or the pipe failed.
+ */
+static unsigned char *spi_pipe_get_full(struct spi_pipe *pipe, int i,
+        size_t *len)
+{
+    unsigned char *buf;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (!pipe->full[i] && !pipe->eof && !pipe->error)
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+    *len = pipe->len[i];
+    buf = pipe->full[i] && !pipe->error ? pipe->buf[i] : NULL;
+    pthread_mutex_unlock(&pipe->lock);
+    return buf;
+}
+
+static void spi_pipe_release(struct spi_pipe *pipe, int i)
+{
+    pthread_mutex_lock(&pipe->lock);
+    pipe->full[i] = 0;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+static int spi_prefix_init(struct spi_prefix *prefix, PyObject *cmd,
+        long long address, int addr_bytes)
+{
+    struct spi_bytes b;
+
+    memset(prefix, 0, sizeof(*prefix));
+    if (cmd != NULL && cmd != Py_None)
+    {
+        if (spi_bytes_get(cmd, &b) < 0)
+            return -1;
+        if (b.len > PREFIX_MAX)
+        {
+            spi_bytes_release(&b);
+            PyErr_Format(PyExc_ValueError, "prefix longer than %d bytes",
+                    PREFIX_MAX);
+            return -1;
+        }
+        memcpy(prefix->buf, b.buf, b.len);
+        prefix->cmd_len = b.len;
+        spi_bytes_release(&b);
+    }
+
+    if (address >= 0)
+    {
+        if (addr_bytes < 1 || addr_bytes > 4)
+        {
+            PyErr_SetString(PyExc_ValueError, "addr_bytes must be 1 to 4");
+            return -1;
+        }
+        prefix->addr_bytes = addr_bytes;
+        prefix->address = address;
+    }
+    return 0;
+}
+
+static size_t spi_prefix_len(struct spi_prefix *prefix)
+{
+    return prefix->cmd_len + prefix->addr_bytes + prefix->dummy_bytes;
+}
+
+/*
+ * SPI NOR fast read commands by bus width: command-address-data, with
+ * the 3 and 4 byte address opcodes and the dummy bytes at the address
+ * width (for 1-4-4 a mode byte and 4 dummy clocks).
+ */
+static const struct spi_flash_read
+{
+    const char *name;
+    uint8_t cmd3;
+    uint8_t cmd4;
+    uint8_t addr_nbits;
+    uint8_t data_nbits;
+    uint8_t dummy_bytes;
+    uint32_t need;            /* mode bits the controller must have */
+} spi_flash_reads[] = {
+    /* best first, for picking automatically */
+    { "1-4-4", 0xeb, 0xec, 4, 4, 3, SPI_TX_QUAD | SPI_RX_QUAD },
+    { "1-1-4", 0x6b, 0x6c, 1, 4, 1, SPI_RX_QUAD },
+    { "1-1-2", 0x3b, 0x3c, 1, 2, 1, SPI_RX_DUAL },
+    { "1-1-1", 0x0b, 0x0c, 1, 1, 1, 0 },
+};
+
+/*
+ * Set prefix up for reading from address with the named protocol, or
+ * the widest one the mode allows when name is NULL.
+ */
+static int spi_flash_protocol(SPI *self, struct spi_prefix *prefix,
+        const char *name, long long address, int addr_bytes)
+{
+    const struct spi_flash_read *fr = NULL;
+    unsigned int i;
+
+    if (addr_bytes != 3 && addr_bytes != 4)
+    {
+        PyErr_SetString(PyExc_ValueError, "addr_bytes must be 3 or 4");
+        return -1;
+    }
+    for (i = 0; i < ARRAY_SIZE(spi_flash_reads) && fr == NULL; i++)
+    {
+        if (name != NULL ? strcmp(name, spi_flash_reads[i].name) == 0
+                : spi_nbits_ok(self->mode, spi_flash_reads[i].addr_nbits,
+                        SPI_TX_DUAL, SPI_TX_QUAD)
+                    && spi_nbits_ok(self->mode, spi_flash_reads[i].data_nbits,
+                        SPI_RX_DUAL, SPI_RX_QUAD))
+            fr = &spi_flash_reads[i];
+    }
+    if (fr == NULL)
+    {
+        PyErr_Format(PyExc_ValueError, "unknown protocol %s", name);
+        return -1;
+    }
+    if (!spi_nbits_ok(self->mode, fr->addr_nbits, SPI_TX_DUAL, SPI_TX_QUAD)
+            || !spi_nbits_ok(self->mode, fr->data_nbits, SPI_RX_DUAL, SPI_RX_QUAD))
+    {
+        PyErr_Format(SpiError, "mode 0x%x doesn't allow %s reads",
+                (unsigned int) self->mode, fr->name);
+        return -1;
+    }
+
+    memset(prefix, 0, sizeof(*prefix));
+    prefix->buf[0] = addr_bytes == 4 ? fr->cmd4 : fr->cmd3;
+    prefix->cmd_len = 1;
+    prefix->addr_bytes = addr_bytes;
+    prefix->address = address;
+    prefix->dummy_bytes = fr->dummy_bytes;
+    prefix->addr_nbits = fr->addr_nbits;
+    prefix->data_nbits = fr->data_nbits;
+    return 0;
+}
+
+/* Lay out the prefix for the next chunk and advance the address past it. */
+static unsigned char *spi_prefix_next(struct spi_prefix *prefix, size_t len)
+{
+    int i;
+
+    for (i = 0; i < prefix->addr_bytes; i++)
+        prefix->buf[prefix->cmd_len + i] =
+                prefix->address >> (8 * (prefix->addr_bytes - 1 - i));
+    prefix->address += len;
+    return prefix->buf;
+}
+
+/* Largest single message: spidev's bufsiz, or a broker slot's payload. */
+static size_t SPI_message_max(SPI *self)
+{
+    size_t max = spi_bufsiz();
+
+    if (self->broker != NULL && max > BROKER_PAYLOAD)
+        max = BROKER_PAYLOAD;
+    return max;
+}
+
+/*
+ * How much data goes in each message of a bulk transfer: what the caller
+ * asked for, else what calibrate() found fastest, else as much as
+ * one message allows after the prefix.
+ */
+static size_t SPI_bulk_chunk(SPI *self, size_t prefix_len,
+        unsigned long long requested)
+{
+    size_t max = SPI_message_max(self) - prefix_len;
+
+    if (requested == 0 && self->seg_size > 0)
+        requested = self->seg_size * self->batch_depth;
+    return requested == 0 || requested > max ? max : requested;
+}
+
+/*
+ * Send one chunk of a bulk transfer: the prefix, if any, then len bytes
+ * from tx and/or into rx, as one message. The data is split into
+ * segments of seg_size when calibrate() found that faster. Called
+ * without the GIL.
+ */
+static int SPI_chunk(SPI *self, struct spi_prefix *prefix,
+        const unsigned char *tx, unsigned char *rx, size_t len)
+{
+    struct spi_ioc_transfer xfer[2 + BULK_MAX_SEGS];
+    unsigned int n = 0, last = BULK_MAX_SEGS;
+    size_t off, seg;
+
+    /* a broker slot carries fewer segments, the last takes the rest */
+    if (self->broker != NULL)
+        last = BROKER_MAX_SEGS - 1;
+
+    memset(xfer, 0, sizeof(xfer));
+    if (spi_prefix_len(prefix) > 0)
+    {
+        xfer[n].len = spi_prefix_len(prefix);
+        xfer[n].tx_buf = (unsigned long) spi_prefix_next(prefix, len);
+        xfer[n].delay_usecs = 0;
+        xfer[n].speed_hz = self->speed;
+        xfer[n].bits_per_word = TRANSFER_BITS;
+        if (prefix->addr_nbits > 1)
+        {
+            /* the command goes on one wire, the address wider */
+            xfer[n + 1] = xfer[n];
+            xfer[n].len = prefix->cmd_len;
+            xfer[n + 1].tx_buf += prefix->cmd_len;
+            xfer[n + 1].len -= prefix->cmd_len;
+            xfer[n + 1].tx_nbits = prefix->addr_nbits;
+            n++;
+        }
+        n++;
+    }
+    for (off = 0; off < len || off == 0; off += seg)
+    {
+        seg = len - off;
+        if (self->seg_size > 0 && seg > self->seg_size && n < last)
+            seg = self->seg_size;
+        xfer[n].tx_buf = tx ? (unsigned long) (tx + off) : 0;
+        xfer[n].rx_buf = rx ? (unsigned long) (rx + off) : 0;
+        xfer[n].len = seg;
+        xfer[n].speed_hz = self->speed;
+        xfer[n].bits_per_word = TRANSFER_BITS;
+        xfer[n].tx_nbits = tx ? prefix->data_nbits : 0;
+        xfer[n].rx_nbits = rx ? prefix->data_nbits : 0;
+        n++;
+        if (seg == 0)
+            break;
+    }
+    xfer[n - 1].delay_usecs = TRANSFER_DELAY_USECS;
+
+    return SPI_message(self, xfer, n);
+}
+
+/* What the writer thread of read_to_fd() needs to know. */
+struct spi_fd_writer
+{
+    struct spi_pipe *pipe;
+    int fd;
+    long long offset;         /* pwrite() from here, or write() when < 0 */
+    int direct;               /* fd has O_DIRECT set */
+};
+
+static void *spi_fd_writer_run(void *arg)
+{
+    struct spi_fd_writer *w = arg;
+    unsigned char *buf;
+    size_t len, done;
+    ssize_t ret;
+    int i = 0, fl;
+
+    while ((buf = spi_pipe_get_full(w->pipe, i, &len)) != NULL)
+    {
+        if (w->direct && len % DIRECT_ALIGN != 0)
+        {
+            /* O_DIRECT wants whole blocks, the tail goes through the cache */
+            fl = fcntl(w->fd, F_GETFL);
+            fcntl(w->fd, F_SETFL, fl & ~O_DIRECT);
+            w->direct = 0;
+        }
+
+        for (done = 0; done < len; done += ret)
+        {
+            if (w->offset >= 0)
+                ret = pwrite(w->fd, buf + done, len - done, w->offset + done);
+            else
+                ret = write(w->fd, buf + done, len - done);
+            if (ret < 0 && errno == EINTR)
+                ret = 0;
+            else if (ret <= 0)
+            {
+                spi_pipe_fail(w->pipe, ret < 0 ? errno : EIO);
+                return NULL;
+            }
+        }
+        if (w->offset >= 0)
+            w->offset += len;
+
+        spi_pipe_release(w->pipe, i);
+        i ^= 1;
+    }
+    return NULL;
+}
+
+/* What the reader thread of write_from_fd() needs to know. */
+struct spi_fd_reader
+{
+    struct spi_pipe *pipe;
+    int fd;
+    long long offset;         /* pread() from here, or read() when < 0 */
+    unsigned long long remaining;
+};
+
+static void *spi_fd_reader_run(void *arg)
+{
+    struct spi_fd_reader *r = arg;
+    unsigned char *buf;
+    size_t want, got;
+    ssize_t ret;
+    int i = 0;
+
+    while (r->remaining > 0 && (buf = spi_pipe_get_empty(r->pipe, i)) != NULL)
+    {
+        want = r->remaining < r->pipe->size ? r->remaining : r->pipe->size;
+        for (got = 0; got < want; got += ret)
+        {
+            if (r->offset >= 0)
+                ret = pread(r->fd, buf + got, want - got, r->offset + got);
+            else
+                ret = read(r->fd, buf + got, want - got);
+            if (ret < 0 && errno == EINTR)
+                ret = 0;
+            else if (ret < 0)
+            {
+                spi_pipe_fail(r->pipe, errno);
+                return NULL;
+            }
+            else if (ret == 0)
+                break; /* end of file */
+        }
+        if (got > 0)
+            spi_pipe_put(r->pipe, i, got);
+        if (got < want)
+            break;
+        if (r->offset >= 0)
+            r->offset += got;
+        r->remaining -= got;
+        i ^= 1;
+    }
+    spi_pipe_eof(r->pipe);
+    return NULL;
+}
+
+/*
+ * A bulk upload: the data either sits in memory (base, len) or arrives
+ * through a pipe from a reader thread.
+ */
+struct spi_upload
+{
+    struct spi_prefix prefix;
+    const unsigned char *base;
+    unsigned long long len;
+    struct spi_pipe *pipe;
+    size_t chunk;
+    PyObject *progress;
+    unsigned long long progress_every;
+};
+
+/*
+ * Feed an upload to the device chunk by chunk, with the GIL released
+ * between progress reports. Returns the bytes sent, or -1 with an
+ * exception set.
+ */
+static long long SPI_upload(SPI *self, struct spi_upload *up)
+{
+    unsigned long long done = 0, next_report;
+    const unsigned char *buf;
+    PyObject *res;
+    size_t len;
+    int i = 0, ret = 0, more = 1;
+
+    while (more && ret >= 0)
+    {
+        next_report = done + up->progress_every;
+
+        SPI_BEGIN_ALLOW_THREADS(self)
+        ret = SPI_flush(self);
+        if (ret == 0)
+            ret = SPI_tune_refresh(self);
+        while (ret >= 0 && done < next_report)
+        {
+            if (up->pipe != NULL)
+            {
+                if ((buf = spi_pipe_get_full(up->pipe, i, &len)) == NULL)
+                {
+                    more = 0;
+                    if (up->pipe->error)
+                    {
+                        ret = -1;
+                        errno = up->pipe->error;
+                    }
+                    break;
+                }
+            }
+            else
+            {
+                if (done == up->len)
+                {
+                    more = 0;
+                    break;
+                }
+                buf = up->base + done;
+                len = up->len - done < up->chunk ? up->len - done : up->chunk;
+            }
+
+            ret = SPI_chunk(self, &up->prefix, buf, NULL, len);
+            if (up->pipe != NULL)
+            {
+                if (ret < 0)
+                    spi_pipe_fail(up->pipe, errno);
+                spi_pipe_release(up->pipe, i);
+                i ^= 1;
+            }
+            if (ret >= 0)
+                done += len;
+        }
+        SPI_END_ALLOW_THREADS(self)
+
+        if (ret < 0)
+        {
+            PyErr_SetFromErrno(PyExc_IOError);
+            break;
+        }
+        if (up->progress != Py_None)
+        {
+            if ((res = PyObject_CallFunction(up->progress, "K", done)) == NULL)
+                ret = -1;
+            Py_XDECREF(res);
+        }
+        if (ret >= 0 && PyErr_CheckSignals() < 0)
+            ret = -1;
+    }
+
+    if (ret < 0 && up->pipe != NULL)
+        spi_pipe_fail(up->pipe, ECANCELED);
+    return ret < 0 ? -1 : (long long) done;
+}
+
+static int SPI_upload_init(SPI *self, struct spi_upload *up, PyObject *cmd,
+        unsigned long long chunk, long long address, int addr_bytes,
+        PyObject *progress, unsigned long long progress_every)
+{
+    memset(up, 0, sizeof(*up));
+    if (progress != Py_None && !PyCallable_Check(progress))
+    {
+        PyErr_SetString(PyExc_TypeError, "progress must be callable");
+        return -1;
+    }
+    if (spi_prefix_init(&up->prefix, cmd, address, addr_bytes) < 0)
+        return -1;
+
+    up->chunk = SPI_bulk_chunk(self, spi_prefix_len(&up->prefix), chunk);
+    up->progress = progress;
+    up->progress_every = progress_every ? progress_every : PROGRESS_EVERY;
+    return 0;
+}
+
+static void spi_job_free(struct spi_job *job)
+{
+    spi_arena_free(job->tx, job->alloc);
+    memset(job, 0, sizeof(*job));
+}
+
+static void spi_sched_free(struct spi_sched *sched)
+{
+    int i;
+
+    if (sched == NULL)
+        return;
+    for (i = 0; i < SCHED_MAX_JOBS; i++)
+        spi_job_free(&sched->job[i]);
+    free(sched);
+}
+
+static int spi_job_pending(struct spi_job *job)
+{
+    return job->id != 0 && !job->finished && !job->cancelled;
+}
+
+/* Number of jobs with something left to send. */
+static int spi_sched_pending(struct spi_sched *sched)
+{
+    int i, pending = 0;
+
+    for (i = 0; i < SCHED_MAX_JOBS; i++)
+        pending += spi_job_pending(&sched->job[i]);
+    return pending;
+}
+
+/*
+ * Called as run() starts: new jobs are released offset after now, and
+ * releases that fell between run() calls move up to now, since time
+ * spent outside run() can't count against a job's deadline.
+ */
+static void spi_sched_start(struct spi_sched *sched, uint64_t now)
+{
+    int i;
+
+    for (i = 0; i < SCHED_MAX_JOBS; i++)
+    {
+        struct spi_job *job = &sched->job[i];
+        if (!spi_job_pending(job) || job->done > 0)
+            continue;
+        if (!job->started)
+        {
+            job->release = now + job->offset_ns;
+            job->started = 1;
+        }
+        else if (job->release < now)
+            job->release = now;
+        else
+            continue;
+        job->due = job->deadline_ns ? job->release + job->deadline_ns : UINT64_MAX;
+    }
+}
+
+/* Free the jobs cancelled while run() was dispatching. */
+static void spi_sched_reap(struct spi_sched *sched)
+{
+    int i;
+
+    for (i = 0; i < SCHED_MAX_JOBS; i++)
+        if (sched->job[i].cancelled)
+            spi_job_free(&sched->job[i]);
+}
+
+/* Earliest deadline first among released jobs, then highest priority. */
+static struct spi_job *spi_sched_pick(struct spi_sched *sched, uint64_t now)
+{
+    struct spi_job *best = NULL;
+    int i;
+
+    for (i = 0; i < SCHED_MAX_JOBS; i++)
+    {
+        struct spi_job *job = &sched->job[i];
+        if (!spi_job_pending(job) || job->release > now)
+            continue;
+        if (best == NULL || job->due < best->due
+                || (job->due == best->due && job->prio > best->prio))
+            best = job;
+    }
+    return best;
+}
+
+static void spi_job_complete(struct spi_job *job, uint64_t now)
+{
+    job->runs++;
+    if (now > job->due)
+    {
+        job->misses++;
+        if (now - job->due > job->worst_late_ns)
+            job->worst_late_ns = now - job->due;
+    }
+
+    job->done = 0;
+    if (job->period_ns == 0)
+    {
+        job->finished = 1;
+        return;
+    }
+
+    /* releases that passed while we were late count as missed */
+    job->release += job->period_ns;
+    while (job->release + job->period_ns <= now)
+    {
+        job->release += job->period_ns;
+        job->misses++;
+    }
+    job->due = job->deadline_ns ? job->release + job->deadline_ns : UINT64_MAX;
+}
+
+/*
+ * Dispatch jobs until "until" or until nothing is left to run. One chunk
+ * goes out per decision, so a newly released urgent job only ever waits
+ * for the chunk in flight. Called without the GIL. Returns the number of
+ * messages sent, or -1 with errno set.
+ */
+static int spi_sched_run(SPI *self, uint64_t until)
+{
+    struct spi_sched *sched = self->sched;
+    struct spi_ioc_transfer xfer;
+    struct spi_job *job;
+    uint64_t now, wake;
+    uint32_t bell;
+    size_t len;
+    int i, pending, sent = 0;
+
+    while ((now = spi_now()) < until)
+    {
+        /* read before the jobs, so a schedule() after this wakes us */
+        bell = sched->doorbell;
+        __sync_synchronize();
+        if ((job = spi_sched_pick(sched, now)) == NULL)
+        {
+            wake = until;
+            pending = 0;
+            for (i = 0; i < SCHED_MAX_JOBS; i++)
+            {
+                if (!spi_job_pending(&sched->job[i]))
+                    continue;
+                pending++;
+                if (sched->job[i].release < wake)
+                    wake = sched->job[i].release;
+            }
+            if (pending == 0)
+                break;
+            /* schedule() may add an earlier job, then wake is redone */
+            spi_futex_wait_until(&sched->doorbell, bell, wake);
+            continue;
+        }
+
+        len = job->len - job->done;
+        if (len > sched->chunk)
+            len = sched->chunk;
+
+        memset(&xfer, 0, sizeof(xfer));
+        xfer.tx_buf = (unsigned long) (job->tx + job->done);
+        xfer.rx_buf = (unsigned long) (job->rx + job->done);
+        xfer.len = len;
+        xfer.delay_usecs = TRANSFER_DELAY_USECS;
+        xfer.speed_hz = self->speed;
+        xfer.bits_per_word = TRANSFER_BITS;
+
+        if (SPI_message(self, &xfer, 1) < 0)
+            return -1;
+        sent++;
+
+        job->done += len;
+        if (job->done == job->len)
+            spi_job_complete(job, spi_now());
+    }
+    return sent;
+}
+
+static void SPIBuffer_dealloc(SPIBuffer *self)
+{
+    SPIBufferPool *pool = self->pool;
+
+    pool->free[pool->nfree++] = self->index;
+    Py_DECREF(pool);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int SPIBuffer_getbuffer(SPIBuffer *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *) self, self->data, self->size,
+            0, flags);
+}
+
+static Py_ssize_t SPIBuffer_length(SPIBuffer *self)
+{
+    return self->size;
+}
+
+static PySequenceMethods SPIBuffer_as_sequence =
+{
+    (lenfunc)SPIBuffer_length, /* sq_length */
+};
+
+static PyBufferProcs SPIBuffer_as_buffer =
+{
+    0, /* bf_getreadbuffer */
+    0, /* bf_getwritebuffer */
+    0, /* bf_getsegcount */
+    0, /* bf_getcharbuffer */
+    (getbufferproc)SPIBuffer_getbuffer, /* bf_getbuffer */
+    0, /* bf_releasebuffer */
+};
+
+PyDoc_STRVAR(SPIBuffer_type_doc,
+        "A buffer from an SPIBufferPool. It supports the buffer protocol,\n"
+        "so memoryview(buf) reads and writes it in place, and write()\n"
+        "sends it without copying.\n");
+
+static PyTypeObject SPIBuffer_type =
+{
+    PyObject_HEAD_INIT(NULL)
+    0,                 /* ob_size */
+    "SPIBuffer",       /* tp_name */
+    sizeof(SPIBuffer), /* tp_basicsize */
+    0, /* tp_itemsize */
+    (destructor)SPIBuffer_dealloc, /* tp_dealloc */
+    0, /* tp_print */
+    0, /* tp_getattr */
+    0, /* tp_setattr */
+    0, /* tp_compare */
+    0, /* tp_repr */
+    0, /* tp_as_number */
+    &SPIBuffer_as_sequence, /* tp_as_sequence */
+    0, /* tp_as_mapping */
+    0, /* tp_hash */
+    0, /* tp_call */
+    0, /* tp_str */
+    0, /* tp_getattro */
+    0, /* tp_setattro */
+    &SPIBuffer_as_buffer, /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+    SPIBuffer_type_doc, /* tp_doc */
+};
+
+static int SPIBufferPool_init(SPIBufferPool *self, PyObject *args,
+        PyObject *kwds)
+{
+    Py_ssize_t size;
+    int count = 8;
+    int hugepages = 0;
+    int lock = 0;
+    int i;
+    static char *kwlist[] = { "size", "count", "hugepages", "lock", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|iii:__init__", kwlist,
+            &size, &count, &hugepages, &lock))
+        return -1;
+
+    if (size <= 0 || count <= 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "size and count must be positive");
+        return -1;
+    }
+    if (self->arena != NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "pool is already initialised");
+        return -1;
+    }
+
+    self->size = size;
+    self->stride = ALIGN_UP(size, sysconf(_SC_PAGESIZE));
+    self->alloc = self->stride * count;
+    self->arena = spi_arena_alloc(&self->alloc,
+            (hugepages ? ARENA_HUGEPAGES : 0) | (lock ? ARENA_LOCKED : 0));
+    if (self->arena == NULL)
+    {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+
+    if ((self->free = malloc(count * sizeof(*self->free))) == NULL)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < count; i++)
+        self->free[i] = count - 1 - i;
+    self->count = count;
+    self->nfree = count;
+    return 0;
+}
+
+static void SPIBufferPool_dealloc(SPIBufferPool *self)
+{
+    spi_arena_free(self->arena, self->alloc);
+    free(self->free);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+PyDoc_STRVAR(SPIBufferPool_get_doc,
+        "get() -> SPIBuffer\n\n"
+        "Take a buffer from the pool. It returns to the pool once no\n"
+        "longer referenced.\n");
+
+static PyObject *SPIBufferPool_get(SPIBufferPool *self)
+{
+    SPIBuffer *buf;
+
+    if (self->nfree == 0)
+    {
+        PyErr_SetString(SpiError, "buffer pool exhausted");
+        return NULL;
+    }
+
+    buf = PyObject_New(SPIBuffer, &SPIBuffer_type);
+    if (buf == NULL)
+        return NULL;
+
+    buf->index = self->free[--self->nfree];
+    buf->data = self->arena + buf->index * self->stride;
+    buf->size = self->size;
+    buf->pool = self;
+    Py_INCREF(self);
+    return (PyObject *) buf;
+}
+
+PyDoc_STRVAR(SPIBufferPool_available_doc,
+        "available() -> count\n\n"
+        "Return the number of buffers get() can still hand out.\n");
+
+static PyObject *SPIBufferPool_available(SPIBufferPool *self)
+{
+    return PyInt_FromLong(self->nfree);
+}
+
+static PyMethodDef SPIBufferPool_methods[] =
+{
+    { "get", (PyCFunction) SPIBufferPool_get, METH_NOARGS, SPIBufferPool_get_doc },
+    { "available", (PyCFunction) SPIBufferPool_available, METH_NOARGS, SPIBufferPool_available_doc },
+    { NULL },
+};
+
+PyDoc_STRVAR(SPIBufferPool_type_doc,
+        "SPIBufferPool(size, count=8, hugepages=False, lock=False)\n\n"
+        "Return a pool of count reusable buffers of size bytes each. The\n"
+        "buffers are page aligned and faulted in up front; with hugepages\n"
+        "they are backed by hugepages where the system allows, and with\n"
+        "lock they are locked into memory.\n");
+
+static PyTypeObject SPIBufferPool_type =
+{
+    PyObject_HEAD_INIT(NULL)
+    0,                 /* ob_size */
+    "SPIBufferPool",   /* tp_name */
+    sizeof(SPIBufferPool), /* tp_basicsize */
+    0, /* tp_itemsize */
+    (destructor)SPIBufferPool_dealloc, /* tp_dealloc */
+    0, /* tp_print */
+    0, /* tp_getattr */
+    0, /* tp_setattr */
+    0, /* tp_compare */
+    0, /* tp_repr */
+    0, /* tp_as_number */
+    0, /* tp_as_sequence */
+    0, /* tp_as_mapping */
+    0, /* tp_hash */
+    0, /* tp_call */
+    0, /* tp_str */
+    0, /* tp_getattro */
+    0, /* tp_setattro */
+    0, /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT, /* tp_flags */
+    SPIBufferPool_type_doc, /* tp_doc */
+    0, /* tp_traverse */
+    0, /* tp_clear */
+    0, /* tp_richcompare */
+    0, /* tp_weaklistoffset */
+    0, /* tp_iter */
+    0, /* tp_iternext */
+    SPIBufferPool_methods, /* tp_methods */
+    0, /* tp_members */
+    0, /* tp_getset */
+    0, /* tp_base */
+    0, /* tp_dict */
+    0, /* tp_descr_get */
+    0, /* tp_descr_set */
+    0, /* tp_dictoffset */
+    (initproc)SPIBufferPool_init, /* tp_init */
+    0, /* tp_alloc */
+    PyType_GenericNew, /* tp_new */
+};
+
+static void SPI_ring_free(SPI *self)
+{
+    int i;
+
+    for (i = 0; i < self->ring_size; i++)
+    {
+        Py_XDECREF(self->ring_view[i]);
+        Py_XDECREF(self->ring_buf[i]);
+    }
+    PyMem_Free(self->ring_view);
+    PyMem_Free(self->ring_buf);
+    self->ring_view = NULL;
+    self->ring_buf = NULL;
+    self->ring_size = 0;
+    self->ring_next = 0;
+}
+
+/*
+ * Return a read-only memoryview of the first len bytes of ring slot i.
+ * The view made for the slot last time around is reused whenever
+ * nobody else holds it or it already has the right length, so the
+ * steady state creates no objects at all.
+ */
+static PyObject *SPI_ring_view(SPI *self, int i, Py_ssize_t len)
+{
+    PyMemoryViewObject *view = (PyMemoryViewObject *) self->ring_view[i];
+    SPIBuffer *buf = (SPIBuffer *) self->ring_buf[i];
+    Py_buffer info;
+
+    if (view == NULL || (Py_REFCNT(view) > 1 && view->view.len != len))
+    {
+        if (PyBuffer_FillInfo(&info, (PyObject *) buf, buf->data, len, 1,
+                PyBUF_FULL_RO) < 0)
+            return NULL;
+        if ((view = (PyMemoryViewObject *) PyMemoryView_FromBuffer(&info)) == NULL)
+        {
+            PyBuffer_Release(&info);
+            return NULL;
+        }
+        Py_XDECREF(self->ring_view[i]);
+        self->ring_view[i] = (PyObject *) view;
+    }
+
+    view->view.len = len;
+    view->view.shape[0] = len;
+    Py_INCREF(view);
+    return (PyObject *) view;
+}
+
+PyDoc_STRVAR(SPI_close_doc,
+        "close()\n\n"
+        "Disconnects the object from the interface.\n"
+        "Calls on this object in other threads are waited for first.\n");
+
+static void *spi_sampler_run(void *arg)
+{
+    SPI *self = arg;
+    struct spi_sampler *sp = self->sampler;
+    struct spi_sample *out = sp->shm;
+    struct timespec real;
+    uint64_t next = spi_now(), now;
+    int ret, i;
+
+    while (!sp->stop)
+    {
+        ret = SPI_message(self, &sp->xfer, 1);
+        now = spi_now();
+        clock_gettime(CLOCK_REALTIME, &real);
+
+        out->seq++;
+        __sync_synchronize();
+        out->count++;
+        out->mono_ns = now;
+        out->real_ns = (uint64_t) real.tv_sec * 1000000000ULL + real.tv_nsec;
+        out->error = ret < 0 ? errno : 0;
+        if (ret >= 0 && sp->keep_length >= 0)
+            for (i = 0; i < sp->keep_length; i++)
+                out->data[i] = sp->rx[sp->keep_idx[i]];
+        else if (ret >= 0)
+            memcpy(out->data, sp->rx, out->len);
+        __sync_synchronize();
+        out->seq++;
+
+        /* sleep until the next sample, waking early for stop_sampler() */
+        next += sp->interval_ns;
+        if (next < now)
+            next = now;
+        while (!sp->stop && (now = spi_now()) + 1000000 < next)
+            spi_futex_wait(&sp->stop, 0, (next - now) / 1000000);
+        if (!sp->stop)
+            spi_sleep_until(next);
+    }
+    return NULL;
+}
+
+static void SPI_stop_sampler(SPI *self)
+{
+    struct spi_sampler *sp = self->sampler;
+
+    if (sp == NULL)
+        return;
+
+    sp->stop = 1;
+    spi_futex_wake(&sp->stop, 1);
+    Py_BEGIN_ALLOW_THREADS
+    pthread_join(sp->thread, NULL);
+    Py_END_ALLOW_THREADS
+
+    sp->shm->magic = 0;
+    munmap(sp->shm, sizeof(*sp->shm));
+    shm_unlink(sp->name);
+    free(sp);
+    self->sampler = NULL;
+}
+
+/* Taken out under self->lock, so no message is still copying into it. */
+static void SPI_unpublish(SPI *self)
+{
+    struct spi_pubstats *pub;
+
+    pthread_mutex_lock(&self->lock);
+    pub = self->pub;
+    self->pub = NULL;
+    pthread_mutex_unlock(&self->lock);
+    if (pub == NULL)
+        return;
+    pub->magic = 0;
+    munmap(pub, sizeof(*pub));
+    shm_unlink(self->pub_name);
+}
+
+/*
+ * Wait until every thread that was between SPI_BEGIN_ALLOW_THREADS() and
+ * SPI_END_ALLOW_THREADS() on this handle has left, so that state taken
+ * out of the handle beforehand can be freed. Threads entering meanwhile
+ * count under the other epoch and can't see that state; while closing,
+ * there are none. Called and returns with the GIL held.
+ */
+static void SPI_quiesce(SPI *self)
+{
+    int old = self->epoch;
+
+    self->epoch ^= 1;
+    while (self->users[old] > 0 || (self->closing && self->users[!old] > 0))
+    {
+        Py_BEGIN_ALLOW_THREADS
+        usleep(QUIESCE_POLL_MS * 1000);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+static PyObject *SPI_close(SPI *self)
+{
+    struct spi_batch *batch;
+    int ret, err = 0;
+
+    if (self->sched != NULL && self->sched->running)
+    {
+        PyErr_SetString(SpiError, "can't close while run() is dispatching");
+        return NULL;
+    }
+
+    SPI_stop_sampler(self);
+
+    if (self->batch != NULL)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        ret = SPI_flush(self);
+        Py_END_ALLOW_THREADS
+        if (ret < 0)
+        {
+            PyErr_SetFromErrno(PyExc_IOError);
+            return NULL;
+        }
+    }
+
+    /* don't leave the bus locked, and don't wait on threads waiting for it */
+    while (self->buslock != NULL && self->buslock->owner == syscall(SYS_gettid))
+        spi_buslock_release(self->buslock);
+
+    /* calls in other threads finish before anything they use is freed */
+    self->closing = 1;
+    batch = self->batch;
+    self->batch = NULL;
+    SPI_quiesce(self);
+    if (batch != NULL)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        if (spi_batch_stop(self, batch) < 0)
+            err = errno;
+        Py_END_ALLOW_THREADS
+    }
+
+    if ((self->fd != -1) && (close(self->fd) == -1))
+    {
+        self->closing = 0;
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+
+    if (self->broker != NULL)
+    {
+        munmap(self->broker, sizeof(*self->broker));
+        self->broker = NULL;
+    }
+
+    if (self->buslock != NULL)
+    {
+        munmap(self->buslock, sizeof(*self->buslock));
+        self->buslock = NULL;
+    }
+
+    self->fd = -1;
+    self->mode = 0;
+    self->bpw = 0;
+    self->msh = 0;
+    self->bus = -1;
+    self->device = -1;
+
+    spi_sched_free(self->sched);
+    self->sched = NULL;
+    SPI_ring_free(self);
+    self->mock = 0;
+    spi_faults_free(self->faults);
+    self->faults = NULL;
+    spi_tune_free(self->tune);
+    self->tune = NULL;
+    self->speed = TRANSFER_SPEED_HZ;
+    self->seg_size = 0;
+    self->batch_depth = 0;
+    spi_kstats_free(self->kstats);
+    self->kstats = NULL;
+    if (self->trace_fd != -1)
+    {
+        close(self->trace_fd);
+        self->trace_fd = -1;
+    }
+    SPI_unpublish(self);
+
+    self->combining = 0;
+    if (self->combiner != NULL)
+    {
+        pthread_mutex_destroy(&self->combiner->lock);
+        free(self->combiner);
+        self->combiner = NULL;
+    }
+    self->closing = 0;
+
+    if (err != 0)
+    {
+        /* the handle is closed, but queued writes were lost */
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_IOError);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static void SPI_dealloc(SPI *self)
+{
+    PyObject *ret = SPI_close(self);
+    if (ret == NULL)
+        PyErr_Clear();
+    Py_XDECREF(ret);
+    pthread_mutex_destroy(&self->lock);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+PyDoc_STRVAR(SPI_transfer_doc,
+        "transfer([values], rx_length=0, keep=None, nbits=0) -> [values]\n\n"
+        "Perform SPI transaction.\n"
+        "nbits of 2 or 4 sends and receives over 2 or 4 wires, when the\n"
+        "mode allows it; see set_mode().\n"
+        "keep selects which received bytes to return: a slice, a list\n"
+        "of offsets or an integer bitmask with bit i keeping byte i.\n"
+        "With a result ring set, returns a read-only memoryview instead\n"
+        "of a tuple; see set_result_ring().\n"
+        "Raises IOError when the message fails.\n"
+        "CS will be released and reactivated between blocks.\n"
+        "delay specifies delay in usec between blocks.\n");
+
+static PyObject* SPI_transfer(SPI *self, PyObject *args, PyObject *kwds)
+{
+    PyObject* obj;
+    PyObject* seq;
+    PyObject* keep = Py_None;
+    PyObject* result;
+    static char *kwlist[] = { "values", "rx_length", "keep", "nbits", NULL };
+
+    int ret;
+    uint8_t bits = TRANSFER_BITS;
+    uint16_t delay = TRANSFER_DELAY_USECS;
+    uint32_t speed = self->speed;
+    int i = 0;
+
+    unsigned char tx_buf[MAX_TRANSFER_LENGTH];
+    unsigned char rx_buf[MAX_TRANSFER_LENGTH];
+    unsigned char *rx = rx_buf;
+    int tx_length;
+    int rx_length = 0;
+    int transfer_length;
+    int slot = -1;
+    PyObject *ring = NULL;
+    uint8_t nbits = 0;
+    uint16_t keep_idx[MAX_TRANSFER_LENGTH];
+    int keep_length = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iOB:transfer", kwlist,
+            &obj, &rx_length, &keep, &nbits))
+        return NULL;
+
+    if ((seq = PySequence_Fast(obj, "Expected a sequence type")) == NULL)
+        return NULL;
+
+    tx_length = PySequence_Fast_GET_SIZE(seq);
+    if (tx_length > MAX_TRANSFER_LENGTH || rx_length > MAX_TRANSFER_LENGTH)
+    {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_OverflowError, "Transfer is too long");
+        return NULL;
+    }
+
+    SPI_PROBE(convert_start, self, tx_length, 1);
+    if (spi_seq_to_buf(seq, tx_buf) < 0)
+    {
+        Py_DECREF(seq);
+        return NULL;
+    }
+    Py_DECREF(seq);
+    SPI_PROBE(convert_end, self, tx_length, 1);
+
+#ifdef VERBOSE_MODE
+    printf ("Length of String List from Python: %d\n", tx_length);
+#endif
+
+    if (tx_length > rx_length)
+    {
+        transfer_length = tx_length;
+    }
+    else
+    {
+        transfer_length = rx_length;
+    }
+
+    if (keep != Py_None
+            && (keep_length = spi_parse_keep(keep, transfer_length, keep_idx)) < 0)
+        return NULL;
+
+    i = tx_length;
+    while (i < transfer_length)
+    {
+        tx_buf[i] = 0;
+        i++;
+    }
+
+#ifdef VERBOSE_MODE
+//printf("TX array size after conversion: %d\n",ARRAY_SIZE(tx));
+
+    printf("Data for SPI to Transmit!!  TX:  ");
+    for (i = 0; i < transfer_length; i++)
+    {
+        printf("%.2X ", tx_buf[i]);
+    }
+    puts(""); // newline
+#endif
+
+    if (self->ring_size > 0)
+    {
+        slot = self->ring_next;
+        self->ring_next = (slot + 1) % self->ring_size;
+        /* set_result_ring() may swap the ring while the GIL is released */
+        ring = self->ring_buf[slot];
+        Py_INCREF(ring);
+        rx = ((SPIBuffer *) ring)->data;
+    }
+
+    /*This is the transfer part, and sets up
+     the details needed to transfer the data*/
+    struct spi_ioc_transfer transfer =
+    {
+        .tx_buf = (unsigned long) tx_buf,
+        .rx_buf = (unsigned long) rx,
+        .len = transfer_length,
+        .delay_usecs = delay,
+        .speed_hz = speed,
+        .bits_per_word = bits,
+        .tx_nbits = nbits,
+        .rx_nbits = nbits,
+    };
+
+    //The actual transfer command and data, does send and receive!! Very important!
+    SPI_BEGIN_ALLOW_THREADS(self)
+    ret = SPI_flush(self);
+    if (ret == 0)
+        ret = SPI_tune_refresh(self);
+    transfer.speed_hz = self->speed;
+    if (ret == 0)
+        ret = SPI_message(self, &transfer, 1);
+    SPI_END_ALLOW_THREADS(self)
+    if (ret < 0)
+    {
+        Py_XDECREF(ring);
+        return PyErr_SetFromErrno(PyExc_IOError);
+    }
+
+#ifdef VERBOSE_MODE
+    //This part prints the Received data of the SPI transmission of equal size to TX
+    //printf("Data that was received from SPI!!  RX:  ");
+
+    for (i = 0; i < transfer_length; i++)
+    {
+        if (!(i % 6))
+        {
+            puts("");
+        }
+        printf("%.2X ", rx[i]);
+    }
+    puts(""); // newline
+#endif
+
+    //return rx data
+    if (keep_length >= 0)
+    {
+        /* gather the wanted bytes before any object is made, tx_buf is
+           free to use as scratch by now */
+        for (i = 0; i < keep_length; i++)
+            tx_buf[i] = rx[keep_idx[i]];
+        if (slot >= 0)
+            memcpy(rx, tx_buf, keep_length);
+        else
+            rx = tx_buf;
+        transfer_length = keep_length;
+    }
+
+    if (ring != NULL && slot < self->ring_size && self->ring_buf[slot] == ring)
+    {
+        Py_DECREF(ring);
+        return SPI_ring_view(self, slot, transfer_length);
+    }
+    /* no ring, or it was replaced meanwhile: rx is still ours to read */
+    SPI_PROBE(result_start, self, transfer_length, 1);
+    result = spi_buf_to_tuple(rx, transfer_length);
+    SPI_PROBE(result_end, self, transfer_length, 1);
+    Py_XDECREF(ring);
+    return result;
+}
+
+PyDoc_STRVAR(SPI_open_doc,
+        "open(bus, device, broker=False, lock=False, priority=PRIO_NORMAL,\n"
+        "     mock=False)\n\n"
+        "Connects the object to the specified SPI device.\n"
+        "open(X,Y) will open /dev/spidev-X.Y\n"
+        "With broker=True messages are handed to the broker started by\n"
+        "spipy.serve(X,Y) instead of opening the device directly.\n"
+        "With lock=True every message holds the cross process bus lock\n"
+        "for X.Y, contending at the given PRIO_* priority class.\n"
+        "With mock=True no device is opened; an emulated one echoes\n"
+        "every byte sent, as if MOSI were wired to MISO.\n");
+
+static int SPI_connect_broker(SPI *self, int bus, int device)
+{
+    char path[MAXPATH];
+    struct spi_broker *broker;
+
+    if (spi_broker_path(path, MAXPATH, bus, device))
+    {
+        PyErr_SetString(PyExc_OverflowError,
+                "Bus and/or device number is invalid.");
+        return -1;
+    }
+
+    if ((broker = spi_broker_map(path, O_RDWR)) == NULL)
+    {
+        PyErr_Format(SpiError, "can't attach to broker: %s", path);
+        return -1;
+    }
+
+    if (broker->magic != BROKER_MAGIC || broker->version != BROKER_VERSION
+            || !spi_broker_alive(broker))
+    {
+        munmap(broker, sizeof(*broker));
+        PyErr_Format(SpiError, "no broker running: %s", path);
+        return -1;
+    }
+
+    self->broker = broker;
+    self->mode = broker->mode;
+    self->bpw = broker->bpw;
+    self->msh = broker->msh;
+    return 0;
+}
+
+/* The device's current mode; kernels before 3.15 only have the 8 bit one. */
+static int spi_read_mode(int fd, uint32_t *mode)
+{
+    uint8_t mode8;
+
+    if (ioctl(fd, SPI_IOC_RD_MODE32, mode) == 0)
+        return 0;
+    if (ioctl(fd, SPI_IOC_RD_MODE, &mode8) == -1)
+        return -1;
+    *mode = mode8;
+    return 0;
+}
+
+static int SPI_connect_device(SPI *self, int bus, int device)
+{
+    char path[MAXPATH];
+    uint8_t tmp8;
+    uint32_t tmp32;
+
+    if (snprintf(path, MAXPATH, "/dev/spidev%d.%d", bus, device) >= MAXPATH)
+    {
+        PyErr_SetString(PyExc_OverflowError,
+                "Bus and/or device number is invalid.");
+        return -1;
+    }
+
+    if ((self->fd = open(path, O_RDWR, 0)) < 0)
+    {
+        char err_str[20 + MAXPATH];
+        sprintf(err_str, "can't open device: %s", path);
+        PyErr_SetString(SpiError, err_str);
+        return -1;
+    }
+
+    if (spi_read_mode(self->fd, &self->mode) < 0)
+    {
+        PyErr_SetString(SpiError, "can't get spi mode");
+        return -1;
+    }
+
+    if (ioctl(self->fd, SPI_IOC_RD_BITS_PER_WORD, &tmp8) == -1)
+    {
+        PyErr_SetString(SpiError, "can't get bits per word");
+        return -1;
+    }
+
+    self->bpw = tmp8;
+    if (ioctl(self->fd, SPI_IOC_RD_MAX_SPEED_HZ, &tmp32) == -1)
+    {
+        PyErr_SetString(SpiError, "can't get max speed hz");
+        return -1;
+    }
+    self->msh = tmp32;
+    return 0;
+}
+
+static int SPI_attach_lock(SPI *self)
+{
+    if (self->buslock != NULL)
+        return 0;
+
+    if (self->bus < 0)
+    {
+        PyErr_SetString(SpiError, "not connected to a device");
+        return -1;
+    }
+
+    if ((self->buslock = spi_buslock_attach(self->bus, self->device)) == NULL)
+    {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    return 0;
+}
+
+static int SPI_set_prio(SPI *self, int prio)
+{
+    if (prio < 0 || prio >= PRIO_CLASSES)
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid priority class");
+        return -1;
+    }
+    self->prio = prio;
+    return 0;
+}
+
+static int SPI_connect_mock(SPI *self)
+{
+    self->mock = 1;
+    self->mode = 0;
+    self->bpw = TRANSFER_BITS;
+    self->msh = MOCK_MAX_SPEED_HZ;
+    return 0;
+}
+
+static int SPI_backend(int broker, int mock)
+{
+    if (broker && mock)
+    {
+        PyErr_SetString(PyExc_ValueError, "broker and mock are exclusive");
+        return -1;
+    }
+    return broker ? BACKEND_BROKER : mock ? BACKEND_MOCK : BACKEND_DEVICE;
+}
+
+static int SPI_connect(SPI *self, int bus, int device, int backend, int lock,
+        int prio)
+{
+    int ret;
+
+    if (backend < 0 || SPI_set_prio(self, prio) < 0)
+        return -1;
+
+    if (backend == BACKEND_BROKER)
+        ret = SPI_connect_broker(self, bus, device);
+    else if (backend == BACKEND_MOCK)
+        ret = SPI_connect_mock(self);
+    else
+        ret = SPI_connect_device(self, bus, device);
+
+    if (ret == 0)
+    {
+        self->bus = bus;
+        self->device = device;
+        if (lock)
+            ret = SPI_attach_lock(self);
+    }
+    return ret;
+}
+
+static PyObject *SPI_open(SPI *self, PyObject *args, PyObject *kwds)
+{
+    int bus, device;
+    int broker = 0;
+    int lock = 0;
+    int prio = PRIO_NORMAL;
+    int mock = 0;
+    static char *kwlist[] = { "bus", "device", "broker", "lock", "priority",
+            "mock", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii|iiii:open", kwlist, &bus,
+            &device, &broker, &lock, &prio, &mock))
+    {
+        return NULL;
+    }
+
+    if (SPI_connect(self, bus, device, SPI_backend(broker, mock), lock, prio) < 0)
+        return NULL; // trigger exception
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static int SPI_init(SPI *self, PyObject *args, PyObject *kwds)
+{
+    int bus = -1;
+    int client = -1;
+    int broker = 0;
+    int lock = 0;
+    int prio = PRIO_NORMAL;
+    int mock = 0;
+    static char *kwlist[] =
+    { "bus", "client", "broker", "lock", "priority", "mock", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiiiii:__init__", kwlist,
+            &bus, &client, &broker, &lock, &prio, &mock))
+        return -1;
+
+    if (bus >= 0)
+    {
+        if (SPI_connect(self, bus, client, SPI_backend(broker, mock), lock,
+                prio) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(SPI_lock_doc,
+        "lock([priority])\n\n"
+        "Take the cross process bus lock for this device, so a sequence\n"
+        "of transfers cannot be interleaved with another process's.\n"
+        "While processes of a higher PRIO_* class are waiting, lower\n"
+        "classes wait behind them. Calls nest; see unlock().\n");
+
+static PyObject *SPI_lock(SPI *self, PyObject *args)
+{
+    struct spi_batch *batch = self->batch;
+    int prio = self->prio;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "|i:lock", &prio))
+        return NULL;
+
+    if (prio < 0 || prio >= PRIO_CLASSES)
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid priority class");
+        return NULL;
+    }
+
+    if (SPI_attach_lock(self) < 0)
+        return NULL;
+
+    SPI_BEGIN_ALLOW_THREADS(self)
+    if (SPI_closed(self))
+        ret = -1;
+    else if (batch != NULL)
+        ret = spi_batch_buslock(self, batch, prio);
+    else
+        ret = spi_buslock_acquire(self->buslock, prio);
+    SPI_END_ALLOW_THREADS(self)
+    if (ret < 0)
+    {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(SPI_unlock_doc,
+        "unlock()\n\n"
+        "Release the bus lock taken by lock(). Writes queued in autobatch\n"
+        "mode are sent first, while the lock is still held.\n");
+
+static PyObject *SPI_unlock(SPI *self)
+{
+    int ret;
+
+    if (self->buslock == NULL || self->buslock->owner != syscall(SYS_gettid))
+    {
+        PyErr_SetString(SpiError, "bus lock is not held");
+        return NULL;
+    }
+
+    SPI_BEGIN_ALLOW_THREADS(self)
+    ret = SPI_flush(self);
+    SPI_END_ALLOW_THREADS(self)
+    /* don't leave the bus locked even if the queue couldn't be sent */
+    if (self->buslock != NULL)
+        spi_buslock_release(self->buslock);
+    if (ret < 0)
+    {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(SPI_schedule_doc,
+        "schedule([values], period=0, deadline=0, priority=PRIO_NORMAL,\n"
+        "         offset=0, rx_length=0) -> job\n\n"
+        "Queue a transaction for run(). Times are in usec. A job with a\n"
+        "period is released every period, otherwise once, offset after\n"
+        "run() starts. Jobs are dispatched earliest deadline first, with\n"
+        "priority breaking ties, and jobs longer than spidev's bufsiz are\n"
+        "sent in bufsiz chunks so urgent jobs can go in between.\n"
+        "The deadline defaults to the period.\n");
+
+static PyObject *SPI_schedule(SPI *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *obj, *seq;
+    struct spi_job *job = NULL;
+    unsigned long long period = 0, deadline = 0, offset = 0;
+    int prio = PRIO_NORMAL;
+    Py_ssize_t tx_length, rx_length = 0, len;
+    int i;
+    static char *kwlist[] = { "values", "period", "deadline", "priority",
+            "offset", "rx_length", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|KKiKn:schedule", kwlist,
+            &obj, &period, &deadline, &prio, &offset, &rx_length))
+        return NULL;
+
+    if (prio < 0 || prio >= PRIO_CLASSES)
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid priority class");
+        return NULL;
+    }
+
+    if (self->sched == NULL)
+    {
+        if ((self->sched = calloc(1, sizeof(*self->sched))) == NULL)
+            return PyErr_NoMemory();
+        self->sched->chunk = SPI_message_max(self);
+    }
+
+    for (i = 0; i < SCHED_MAX_JOBS && job == NULL; i++)
+        if (self->sched->job[i].id == 0)
+            job = &self->sched->job[i];
+    if (job == NULL)
+    {
+        PyErr_SetString(SpiError, "too many scheduled jobs");
+        return NULL;
+    }
+
+    if ((seq = PySequence_Fast(obj, "Expected a sequence type")) == NULL)
+        return NULL;
+
+    tx_length = PySequence_Fast_GET_SIZE(seq);
+    len = tx_length > rx_length ? tx_length : rx_length;
+    if (len == 0)
+    {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_ValueError, "empty transaction");
+        return NULL;
+    }
+
+    job->alloc = ALIGN_UP(len, CACHELINE_SIZE) + len;
+    if ((job->tx = spi_arena_alloc(&job->alloc, 0)) == NULL)
+    {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    job->rx = job->tx + ALIGN_UP(len, CACHELINE_SIZE);
+    if (spi_seq_to_buf(seq, job->tx) < 0)
+    {
+        Py_DECREF(seq);
+        spi_job_free(job);
+        return NULL;
+    }
+    Py_DECREF(seq);
+
+    job->len = len;
+    job->prio = prio;
+    job->period_ns = period * 1000;
+    job->deadline_ns = (deadline ? deadline : period) * 1000;
+    job->offset_ns = offset * 1000;
+    if (self->sched->running)
+    {
+        /* run() has started already, count from now */
+        job->release = spi_now() + job->offset_ns;
+        job->due = job->deadline_ns ? job->release + job->deadline_ns : UINT64_MAX;
+        job->started = 1;
+    }
+    /* a running dispatcher may pick the job up as soon as it has an id */
+    __sync_synchronize();
+    job->id = ++self->sched->next_id;
+    if (self->sched->running)
+    {
+        /* it may be asleep until a later release */
+        __sync_fetch_and_add(&self->sched->doorbell, 1);
+        spi_futex_wake(&self->sched->doorbell, 1);
+    }
+
+    return PyInt_FromLong(job->id);
+}
+
+static struct spi_job *SPI_find_job(SPI *self, int id)
+{
+    int i;
+
+    for (i = 0; self->sched != NULL && i < SCHED_MAX_JOBS; i++)
+        if (id != 0 && self->sched->job[i].id == id
+                && !self->sched->job[i].cancelled)
+            return &self->sched->job[i];
+
+    PyErr_SetString(PyExc_KeyError, "no such job");
+    return NULL;
+}
+
+PyDoc_STRVAR(SPI_cancel_doc,
+        "cancel(job)\n\n"
+        "Remove a job queued with schedule(). A chunk of it already in\n"
+        "flight in another thread's run() still completes.\n");
+
+static PyObject *SPI_cancel(SPI *self, PyObject *args)
+{
+    struct spi_job *job;
+    int id;
+
+    if (!PyArg_ParseTuple(args, "i:cancel", &id))
+        return NULL;
+    if ((job = SPI_find_job(self, id)) == NULL)
+        return NULL;
+
+    /* run() may be sending from the job's buffer right now */
+    if (self->sched->running)
+        job->cancelled = 1;
+    else
+        spi_job_free(job);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(SPI_run_doc,
+        "run(seconds) -> messages\n\n"
+        "Dispatch scheduled jobs for the given time, or until no job has\n"
+        "anything left to send. Returns the number of messages sent.\n"
+        "Time spent outside run() doesn't count against deadlines:\n"
+        "releases missed meanwhile are moved up to when run() starts.\n");
+
+static PyObject *SPI_run(SPI *self, PyObject *args)
+{
+    double seconds;
+    uint64_t until, slice;
+    long total = 0;
+    int sent;
+
+    if (!PyArg_ParseTuple(args, "d:run", &seconds))
+        return NULL;
+
+    if (self->sched == NULL)
+        return PyInt_FromLong(0);
+    if (self->sched->running)
+    {
+        PyErr_SetString(SpiError, "run() is already dispatching");
+        return NULL;
+    }
+
+    self->sched->running = 1;
+    spi_sched_start(self->sched, spi_now());
+    until = spi_now() + (uint64_t) (seconds * 1e9);
+    do
+    {
+        slice = spi_now() + SCHED_SLICE_MS * 1000000ULL;
+        if (slice > until)
+            slice = until;
+
+        SPI_BEGIN_ALLOW_THREADS(self)
+        sent = SPI_flush(self);
+        if (sent == 0)
+            sent = spi_sched_run(self, slice);
+        SPI_END_ALLOW_THREADS(self)
+
+        if (sent < 0)
+        {
+            PyErr_SetFromErrno(PyExc_IOError);
+            break;
+        }
+        total += sent;
+        if (PyErr_CheckSignals() < 0)
+            break;
+    } while (spi_now() < until
+            && (sent > 0 || spi_sched_pending(self->sched) > 0));
+
+    self->sched->running = 0;
+    spi_sched_reap(self->sched);
+    if (PyErr_Occurred())
+        return NULL;
+    return PyInt_FromLong(total);
+}
+
+PyDoc_STRVAR(SPI_result_doc,
+        "result(job) -> [values]\n\n"
+        "Return the data received by the last completed run of a job,\n"
+        "or None if it has not completed yet.\n");
+
+static PyObject *SPI_result(SPI *self, PyObject *args)
+{
+    struct spi_job *job;
+    int id;
+
+    if (!PyArg_ParseTuple(args, "i:result", &id))
+        return NULL;
+    if ((job = SPI_find_job(self, id)) == NULL)
+        return NULL;
+
+    if (job->runs == 0)
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    return spi_buf_to_tuple(job->rx, job->len);
+}
+
+PyDoc_STRVAR(SPI_schedule_stats_doc,
+        "schedule_stats() -> {job: (runs, misses, worst_late_usec)}\n\n"
+        "Report how many times each job ran, how many of its deadlines\n"
+        "were missed and by how much at worst.\n");
+
+static PyObject *SPI_schedule_stats(SPI *self)
+{
+    PyObject *dict, *val, *key;
+    int i;
+
+    if ((dict = PyDict_New()) == NULL)
+        return NULL;
+
+    for (i = 0; self->sched != NULL && i < SCHED_MAX_JOBS; i++)
+    {
+        struct spi_job *job = &self->sched->job[i];
+        if (job->id == 0 || job->cancelled)
+            continue;
+
+        key = PyInt_FromLong(job->id);
+        val = Py_BuildValue("(IIK)", job->runs, job->misses,
+                (unsigned long long) (job->worst_late_ns / 1000));
+        if (key == NULL || val == NULL || PyDict_SetItem(dict, key, val) < 0)
+        {
+            Py_XDECREF(key);
+            Py_XDECREF(val);
+            Py_DECREF(dict);
+            return NULL;
+        }
+        Py_DECREF(key);
+        Py_DECREF(val);
+    }
+    return dict;
+}
+
+PyDoc_STRVAR(SPI_set_speed_doc,
+        "set_speed(hz)\n\n"
+        "Set the clock speed used for this handle's messages. 0 goes\n"
+        "back to the default of 1 MHz.\n");
+
+static PyObject *SPI_set_speed(SPI *self, PyObject *args)
+{
+    unsigned int hz;
+
+    if (!PyArg_ParseTuple(args, "I:set_speed", &hz))
+        return NULL;
+
+    self->speed = hz ? hz : TRANSFER_SPEED_HZ;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(SPI_autotune_doc,
+        "autotune(probe, verify=None, trials=8, margin=0.8, min_hz=100000,\n"
+        "         max_hz=0, reverify=0) -> hz\n\n"
+        "Find the fastest clock at which sending probe gets verify back\n"
+        "trials times in a row (verify defaults to probe itself, for a\n"
+        "loopback), searching from min_hz to max_hz, which defaults to\n"
+        "the device's maximum. The handle then runs at margin times that\n"
+        "speed, which is returned. With reverify, in seconds, transfers\n"
+        "check again that often and search the whole range again if the\n"
+        "probe has stopped passing, so the speed can recover as well as\n"
+        "drop. If even min_hz fails then, the transfer raises IOError\n"
+        "(EIO) and the next one searches again.\n");
+
+static PyObject *SPI_autotune(SPI *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *probe_obj, *verify_obj = Py_None;
+    struct spi_bytes probe, verify;
+    struct spi_tune *tune, *old;
+    unsigned int min_hz = TUNE_MIN_HZ, max_hz = 0;
+    double margin = 0.8, reverify = 0;
+    int trials = 8;
+    long found;
+    static char *kwlist[] = { "probe", "verify", "trials", "margin",
+            "min_hz", "max_hz", "reverify", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OidIId:autotune", kwlist,
+            &probe_obj, &verify_obj, &trials, &margin, &min_hz, &max_hz,
+            &reverify))
+        return NULL;
+
+    if (max_hz == 0)
+        max_hz = self->msh;
+    if (trials < 1 || margin <= 0 || margin > 1 || min_hz == 0
+            || max_hz < min_hz || reverify < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid autotune parameters");
+        return NULL;
+    }
+
+    if (spi_bytes_get(probe_obj, &probe) < 0)
+        return NULL;
+    if (spi_bytes_get(verify_obj == Py_None ? probe_obj : verify_obj, &verify) < 0)
+    {
+        spi_bytes_release(&probe);
+        return NULL;
+    }
+    if (probe.len == 0 || probe.len != verify.len
+            || (size_t) probe.len > spi_bufsiz())
+    {
+        spi_bytes_release(&probe);
+        spi_bytes_release(&verify);
+        PyErr_SetString(PyExc_ValueError,
+                "probe and verify must be the same length, up to bufsiz");
+        return NULL;
+    }
+
+    if ((tune = calloc(1, sizeof(*tune))) == NULL)
+    {
+        spi_bytes_release(&probe);
+        spi_bytes_release(&verify);
+        return PyErr_NoMemory();
+    }
+    tune->len = probe.len;
+    tune->alloc = 3 * probe.len;
+    if ((tune->probe = spi_arena_alloc(&tune->alloc, 0)) == NULL)
+    {
+        free(tune);
+        spi_bytes_release(&probe);
+        spi_bytes_release(&verify);
+        return PyErr_NoMemory();
+    }
+    pthread_mutex_init(&tune->lock, NULL);
+    tune->expected = tune->probe + probe.len;
+    tune->rx = tune->expected + probe.len;
+    memcpy(tune->probe, probe.buf, probe.len);
+    memcpy(tune->expected, verify.buf, verify.len);
+    spi_bytes_release(&probe);
+    spi_bytes_release(&verify);
+
+    tune->trials = trials;
+    tune->margin = margin;
+    tune->min_hz = min_hz;
+    tune->max_hz = max_hz;
+    tune->interval_ns = reverify * 1e9;
+
+    if (self->swapping)
+    {
+        spi_tune_free(tune);
+        PyErr_SetString(SpiError, "another thread is replacing the handle's state");
+        return NULL;
+    }
+    self->swapping = 1;
+
+    SPI_BEGIN_ALLOW_THREADS(self)
+    found = SPI_flush(self);
+    if (found == 0)
+        found = spi_tune_search(self, tune, max_hz);
+    SPI_END_ALLOW_THREADS(self)
+
+    if (found <= 0)
+    {
+        self->swapping = 0;
+        if (found < 0)
+            PyErr_SetFromErrno(PyExc_IOError);
+        else
+            PyErr_Format(SpiError, "probe fails even at %u Hz", min_hz);
+        spi_tune_free(tune);
+        return NULL;
+    }
+
+    /* transfers in other threads may still be re-verifying with the old one */
+    old = self->tune;
+    self->tune = tune;
+    if (old != NULL)
+    {
+        SPI_quiesce(self);
+        spi_tune_free(old);
+    }
+    self->swapping = 0;
+    return PyLong_FromUnsignedLong(self->speed);
+}
+
+/*
+ * The calibrate() cache is a text file with one line per device, backend,
+ * clock speed and bufsiz:
+ * "spidevX.Y backend speed bufsiz seg_size batch_depth", where backend is
+ * "device", "broker" or "mock". Lines in any other layout are ignored.
+ */
+static int spi_cache_load(const char *path, const char *key, size_t *seg,
+        unsigned int *depth)
+{
+    char line[128], name[32], backend[16];
+    unsigned long speed, bufsiz, s;
+    unsigned int d;
+    char want[80];
+    FILE *f;
+    int found = 0;
+
+    if ((f = fopen(path, "r")) == NULL)
+        return 0;
+    while (!found && fgets(line, sizeof(line), f) != NULL)
+    {
+        if (sscanf(line, "%31s %15s %lu %lu %lu %u", name, backend, &speed,
+                &bufsiz, &s, &d) != 6)
+            continue;
+        snprintf(want, sizeof(want), "%s %s %lu %lu", name, backend, speed,
+                bufsiz);
+        if (strcmp(want, key) == 0 && s > 0 && d > 0)
+        {
+            *seg = s;
+            *depth = d;
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+static int spi_cache_store(const char *path, const char *key, size_t seg,
+        unsigned int depth)
+{
+    char line[128], tmp[PATH_MAX];
+    FILE *in, *out;
+    size_t keylen = strlen(key);
+
+    if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid()) >= (int) sizeof(tmp))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((out = fopen(tmp, "w")) == NULL)
+        return -1;
+
+    if ((in = fopen(path, "r")) != NULL)
+    {
+        while (fgets(line, sizeof(line), in) != NULL)
+            if (strncmp(line, key, keylen) != 0 || line[keylen] != ' ')
+                fputs(line, out);
+        fclose(in);
+    }
+    fprintf(out, "%s %lu %u\n", key, (unsigned long) seg, depth);
+
+    if (fclose(out) != 0 || rename(tmp, path) == -1)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(SPI_calibrate_doc,
+        "calibrate(nbytes=16384, sizes=None, depths=None, cache=None,\n"
+        "          force=False) -> dict\n\n"
+        "Find the segment size and number of segments per message that\n"
+        "move bulk data fastest on this controller, by reading nbytes\n"
+        "with every combination whose message fits in bufsiz, or in a\n"
+        "broker slot on a broker handle. sizes defaults to powers of two\n"
+        "from 64 to that limit, depths to 1 to 16.\n"
+        "read_to_fd(), write_from_fd() and write_from_mmap() use the\n"
+        "winner from then on. With cache, a path, a result stored there\n"
+        "for this device, backend (device, broker or mock), speed and\n"
+        "bufsiz is used without measuring, unless force is set, and new\n"
+        "results are saved to it.\n"
+        "Returns the chosen segment size and depth and, when measured,\n"
+        "the throughput and time per message of every combination.\n");
+
+static PyObject *SPI_calibrate(SPI *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *sizes_obj = Py_None, *depths_obj = Py_None, *results, *item;
+    PyObject *sizes = NULL, *depths = NULL;
+    const char *cache = NULL;
+    char key[80];
+    unsigned long long nbytes = CALIBRATE_BYTES, done;
+    size_t bufsiz = SPI_message_max(self), alloc, seg, best_seg = 0;
+    size_t old_seg = self->seg_size;
+    unsigned int depth, best_depth = 0, old_depth = self->batch_depth;
+    unsigned int max_depth = self->broker ? BROKER_MAX_SEGS : BULK_MAX_SEGS;
+    double best = 0, rate, elapsed;
+    unsigned long messages;
+    struct spi_prefix prefix;
+    unsigned char *rx;
+    uint64_t start;
+    Py_ssize_t i, j;
+    int force = 0, ret = 0;
+    static char *kwlist[] = { "nbytes", "sizes", "depths", "cache", "force",
+            NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|KOOzi:calibrate", kwlist,
+            &nbytes, &sizes_obj, &depths_obj, &cache, &force))
+        return NULL;
+
+    /* a broker slot or the mock is a different pipe to the same device */
+    snprintf(key, sizeof(key), "spidev%d.%d %s %lu %lu", self->bus, self->device,
+            self->broker != NULL ? "broker" : self->mock ? "mock" : "device",
+            (unsigned long) self->speed, (unsigned long) bufsiz);
+    if (cache != NULL && !force
+            && spi_cache_load(cache, key, &best_seg, &best_depth))
+    {
+        self->seg_size = best_seg;
+        self->batch_depth = best_depth;
+        return Py_BuildValue("{s:k,s:I}", "segment", (unsigned long) best_seg,
+                "depth", best_depth);
+    }
+
+    if (sizes_obj == Py_None)
+    {
+        sizes = PyList_New(0);
+        for (seg = 64; sizes != NULL && seg <= bufsiz; seg *= 2)
+        {
+            item = PyInt_FromSize_t(seg);
+            if (item == NULL || PyList_Append(sizes, item) < 0)
+                Py_CLEAR(sizes);
+            Py_XDECREF(item);
+        }
+    }
+    else
+        sizes = PySequence_Fast(sizes_obj, "sizes must be a sequence");
+    if (depths_obj == Py_None)
+        depths = Py_BuildValue("[iiiii]", 1, 2, 4, 8, 16);
+    else
+        depths = PySequence_Fast(depths_obj, "depths must be a sequence");
+    if (sizes == NULL || depths == NULL || (results = PyList_New(0)) == NULL)
+    {
+        Py_XDECREF(sizes);
+        Py_XDECREF(depths);
+        return NULL;
+    }
+
+    alloc = bufsiz;
+    if ((rx = spi_arena_alloc(&alloc, 0)) == NULL)
+    {
+        Py_DECREF(sizes);
+        Py_DECREF(depths);
+        Py_DECREF(results);
+        return PyErr_NoMemory();
+    }
+    memset(&prefix, 0, sizeof(prefix));
+
+    SPI_BEGIN_ALLOW_THREADS(self)
+    ret = SPI_flush(self);
+    SPI_END_ALLOW_THREADS(self)
+
+    for (i = 0; ret >= 0 && i < PySequence_Fast_GET_SIZE(sizes); i++)
+    {
+        seg = PyInt_AsSsize_t(PySequence_Fast_GET_ITEM(sizes, i));
+        for (j = 0; ret >= 0 && j < PySequence_Fast_GET_SIZE(depths); j++)
+        {
+            depth = PyInt_AsLong(PySequence_Fast_GET_ITEM(depths, j));
+            if (PyErr_Occurred())
+            {
+                ret = -2;
+                break;
+            }
+            if (seg == 0 || depth == 0 || depth > max_depth
+                    || seg * depth > bufsiz)
+                continue;
+
+            self->seg_size = seg;
+            self->batch_depth = depth;
+            messages = 0;
+
+            SPI_BEGIN_ALLOW_THREADS(self)
+            start = spi_now();
+            if (SPI_closed(self))
+                ret = -1;
+            for (done = 0; ret >= 0 && done < nbytes; done += seg * depth)
+            {
+                ret = SPI_chunk(self, &prefix, NULL, rx, seg * depth);
+                messages++;
+            }
+            elapsed = (spi_now() - start) / 1e9;
+            SPI_END_ALLOW_THREADS(self)
+
+            if (ret < 0)
+                break;
+            rate = elapsed > 0 ? done / elapsed : 0;
+            item = Py_BuildValue("(kIdd)", (unsigned long) seg, depth, rate,
+                    elapsed * 1e6 / messages);
+            if (item == NULL || PyList_Append(results, item) < 0
+                    || PyErr_CheckSignals() < 0)
+                ret = -2;
+            Py_XDECREF(item);
+            if (rate > best)
+            {
+                best = rate;
+                best_seg = seg;
+                best_depth = depth;
+            }
+        }
+    }
+    spi_arena_free(rx, alloc);
+    Py_DECREF(sizes);
+    Py_DECREF(depths);
+
+    self->seg_size = old_seg;
+    self->batch_depth = old_depth;
+    if (ret < 0 || best_seg == 0)
+    {
+        if (ret == -1)
+            PyErr_SetFromErrno(PyExc_IOError);
+        else if (ret == 0)
+            PyErr_SetString(PyExc_ValueError, "no segment size and depth fit in bufsiz");
+        Py_DECREF(results);
+        return NULL;
+    }
+
+    self->seg_size = best_seg;
+    self->batch_depth = best_depth;
+    if (cache != NULL && spi_cache_store(cache, key, best_seg, best_depth) < 0)
+    {
+        Py_DECREF(results);
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) cache);
+    }
+
+    return Py_BuildValue("{s:k,s:I,s:d,s:N}", "segment",
+            (unsigned long) best_seg, "depth", best_depth, "throughput", best,
+            "results", results);
+}
+
+static PyObject *spi_kstats_dict(struct spi_kstats *ks, int d,
+        uint64_t value[2][KSTAT_FILES])
+{
+    PyObject *dict, *histo, *item;
+    int i, any = 0;
+
+    for (i = 0; i < KSTAT_FILES; i++)
+        any |= ks->fd[d][i] != -1;
+    if (!any)
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    if ((dict = PyDict_New()) == NULL)
+        return NULL;
+    for (i = 0; i < KSTAT_COUNTERS; i++)
+    {
+        if (ks->fd[d][i] == -1)
+            continue;
+        item = PyLong_FromUnsignedLongLong(value[d][i]);
+        if (item == NULL || PyDict_SetItemString(dict, spi_kstat_names[i], item) < 0)
+        {
+            Py_XDECREF(item);
+            Py_DECREF(dict);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+
+    /* (smallest size in the bucket, transfers) */
+    if ((histo = PyList_New(KSTAT_HISTO)) == NULL)
+    {
+        Py_DECREF(dict);
+        return NULL;
+    }
+    for (i = 0; i < KSTAT_HISTO; i++)
+        PyList_SET_ITEM(histo, i, Py_BuildValue("(IK)", i == 0 ? 0 : 1u << i,
+                (unsigned long long) value[d][KSTAT_COUNTERS + i]));
+    if (PyDict_SetItemString(dict, "histogram", histo) < 0)
+    {
+        Py_DECREF(histo);
+        Py_DECREF(dict);
+        return NULL;
+    }
+    Py_DECREF(histo);
+    return dict;
+}
+
+PyDoc_STRVAR(SPI_kernel_stats_doc,
+        "kernel_stats() -> dict\n\n"
+        "Read the kernel's statistics for this bus's controller and for\n"
+        "this device from sysfs, as 'controller' and 'device' dicts\n"
+        "(None when the kernel doesn't have them). 'delta' compares what\n"
+        "changed since the previous call with this handle's own stats():\n"
+        "messages the kernel saw against messages sent from here, bytes\n"
+        "and errors likewise, and the time spent in the driver against\n"
+        "the time the bytes take on the wire at the current speed. The\n"
+        "files are opened on the first call and kept open until close().\n");
+
+static PyObject *SPI_kernel_stats(SPI *self)
+{
+    uint64_t value[2][KSTAT_FILES], now, wire_ns, io_ns;
+    struct spi_stats user = self->stats;
+    struct spi_kstats *ks;
+    PyObject *ctl, *dev, *delta;
+    int d;
+
+    if (self->kstats == NULL)
+    {
+        if (self->bus < 0)
+        {
+            PyErr_SetString(SpiError, "not open");
+            return NULL;
+        }
+        if ((self->kstats = spi_kstats_open(self->bus, self->device)) == NULL)
+            return PyErr_Format(SpiError, "no kernel statistics for spidev%d.%d",
+                    self->bus, self->device);
+        spi_kstats_read(self->kstats, self->kstats->last);
+        self->kstats->user = user;
+        self->kstats->when = spi_now();
+    }
+    ks = self->kstats;
+
+    spi_kstats_read(ks, value);
+    now = spi_now();
+    /* compare against the device when it has counters, else the controller */
+    d = ks->fd[1][0] != -1 ? 1 : 0;
+
+    if ((ctl = spi_kstats_dict(ks, 0, value)) == NULL)
+        return NULL;
+    if ((dev = spi_kstats_dict(ks, 1, value)) == NULL)
+    {
+        Py_DECREF(ctl);
+        return NULL;
+    }
+
+#define KDELTA(i) ((unsigned long long) (value[d][i] - ks->last[d][i]))
+#define UDELTA(f) ((unsigned long long) (user.f - ks->user.f))
+    io_ns = user.io_ns - ks->user.io_ns;
+    wire_ns = self->speed ? KDELTA(7) * 8 * 1000000000ULL / self->speed : 0;
+    delta = Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:L}",
+            "interval_usec", (unsigned long long) (now - ks->when) / 1000,
+            "messages", KDELTA(0),
+            "user_messages", UDELTA(transfers),
+            "bytes", KDELTA(7),
+            "user_bytes", UDELTA(bytes),
+            "errors", KDELTA(2),
+            "timedout", KDELTA(3),
+            "user_errors", UDELTA(errors),
+            "io_usec", (unsigned long long) io_ns / 1000,
+            "wire_usec", (unsigned long long) wire_ns / 1000,
+            "overhead_usec", ((long long) io_ns - (long long) wire_ns) / 1000);
+#undef KDELTA
+#undef UDELTA
+    if (delta == NULL)
+    {
+        Py_DECREF(ctl);
+        Py_DECREF(dev);
+        return NULL;
+    }
+
+    memcpy(ks->last, value, sizeof(value));
+    ks->user = user;
+    ks->when = now;
+
+    return Py_BuildValue("{s:N,s:N,s:N}", "controller", ctl, "device", dev,
+            "delta", delta);
+}
+
+PyDoc_STRVAR(SPI_set_trace_markers_doc,
+        "set_trace_markers(enabled=True, path=None)\n\n"
+        "Write a marker to the ftrace trace_marker file just before and\n"
+        "just after each message goes to the driver, \"spipy X.Y B\" and\n"
+        "\"spipy X.Y E\", so a trace with the kernel's spi:* events shows\n"
+        "how long each one spends in the driver and around it. path\n"
+        "defaults to tracefs, then debugfs. The file is opened here and\n"
+        "the markers prepared here, so sending only costs the writes.\n");
+
+static PyObject *SPI_set_trace_markers(SPI *self, PyObject *args, PyObject *kwds)
+{
+    const char *path = NULL;
+    int enabled = 1, fd;
+    static char *kwlist[] = { "enabled", "path", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iz:set_trace_markers",
+            kwlist, &enabled, &path))
+        return NULL;
+
+    if (enabled)
+    {
+        if (self->bus < 0)
+        {
+            PyErr_SetString(SpiError, "not open");
+            return NULL;
+        }
+        if (path != NULL)
+            fd = open(path, O_WRONLY | O_CLOEXEC);
+        else if ((fd = open(TRACE_MARKER, O_WRONLY | O_CLOEXEC)) == -1)
+            fd = open(path = TRACE_MARKER_DEBUGFS, O_WRONLY | O_CLOEXEC);
+        if (fd == -1)
+            return PyErr_SetFromErrnoWithFilename(PyExc_IOError,
+                    (char *) (path ? path : TRACE_MARKER));
+    }
+    else
+        fd = -1;
+
+    if (fd != -1)
+    {
+        self->trace_begin_len = snprintf(self->trace_begin, TRACE_MARKER_MAX,
+                "spipy %d.%d B\n", self->bus, self->device);
+        self->trace_end_len = snprintf(self->trace_end, TRACE_MARKER_MAX,
+                "spipy %d.%d E\n", self->bus, self->device);
+    }
+    if (self->trace_fd != -1)
+        close(self->trace_fd);
+    self->trace_fd = fd;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(SPI_publish_stats_doc,
+        "publish_stats(enabled=True, name=None) -> str\n\n"
+        "Keep a copy of this handle's counters, and a histogram of the\n"
+        "time messages spend in the driver, in POSIX shared memory where\n"
+        "a monitoring process can read them without touching this one,\n"
+        "e.g. with spipy.read_stats(). name defaults to\n"
+        "/spipy-stats-X.Y-PID. The segment is removed by\n"
+        "publish_stats(False) or close(). Returns the name. Only one\n"
+        "handle may publish under a name; SpiError is raised while\n"
+        "another one, in any process, still does.\n");
+
+/* Is the segment called name published by a process still running? */
+static int spi_pub_in_use(const char *name)
+{
+    struct spi_pubstats *pub;
+    struct stat st;
+    int fd, used;
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+        return 0;
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(*pub)
+            || (pub = mmap(NULL, sizeof(*pub), PROT_READ, MAP_SHARED, fd, 0))
+                    == MAP_FAILED)
+    {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    used = pub->magic == PUB_MAGIC && spi_pid_alive(pub->pid);
+    munmap(pub, sizeof(*pub));
+    return used;
+}
+
+static PyObject *SPI_publish_stats(SPI *self, PyObject *args, PyObject *kwds)
+{
+    struct spi_pubstats *pub;
+    const char *name = NULL;
+    int enabled = 1, fd;
+    static char *kwlist[] = { "enabled", "name", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iz:publish_stats", kwlist,
+            &enabled, &name))
+        return NULL;
+
+    if (!enabled)
+    {
+        SPI_unpublish(self);
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    if (self->bus < 0)
+    {
+        PyErr_SetString(SpiError, "not open");
+        return NULL;
+    }
+    if (self->pub != NULL)
+        return PyString_FromString(self->pub_name);
+
+    if (name == NULL)
+        snprintf(self->pub_name, PUB_NAME_MAX, "/spipy-stats-%d.%d-%d",
+                self->bus, self->device, (int) getpid());
+    else if (snprintf(self->pub_name, PUB_NAME_MAX, "%s", name) >= PUB_NAME_MAX)
+    {
+        PyErr_SetString(PyExc_ValueError, "name is too long");
+        return NULL;
+    }
+
+    /* one writer per segment: take over only from a publisher that died */
+    fd = shm_open(self->pub_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 && errno == EEXIST && !spi_pub_in_use(self->pub_name))
+    {
+        shm_unlink(self->pub_name);
+        fd = shm_open(self->pub_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if (fd < 0 && errno == EEXIST)
+    {
+        PyErr_Format(SpiError, "%s is published by another handle",
+                self->pub_name);
+        return NULL;
+    }
+    if (fd < 0)
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, self->pub_name);
+    if (ftruncate(fd, sizeof(*pub)) == -1
+            || (pub = mmap(NULL, sizeof(*pub), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, self->pub_name);
+        close(fd);
+        shm_unlink(self->pub_name);
+        return NULL;
+    }
+    close(fd);
+
+    pub->version = PUB_VERSION;
+    pub->size = sizeof(*pub);
+    pub->pid = getpid();
+    pub->bus = self->bus;
+    pub->device = self->device;
+    pub->lat_buckets = PUB_LAT_BUCKETS;
+    pub->transfers = self->stats.transfers;
+    pub->segments = self->stats.segments;
+    pub->bytes = self->stats.bytes;
+    pub->errors = self->stats.errors;
+    pub->throttled = self->stats.throttled;
+    pub->throttle_ns = self->stats.throttle_ns;
+    pub->io_ns = self->stats.io_ns;
+    __sync_synchronize();
+    pub->magic = PUB_MAGIC;
+    self->pub = pub;
+
+    return PyString_FromString(self->pub_name);
+}
+
+PyDoc_STRVAR(SPI_start_sampler_doc,
+        "start_sampler(values, interval, rx_length=0, keep=None, name=None)\n"
+        "    -> str\n\n"
+        "Start a thread that does transfer(values, rx_length) every\n"
+        "interval seconds and publishes the latest result, the bytes\n"
+        "picked by keep if given, in POSIX shared memory named name,\n"
+        "/spipy-sample-X.Y-PID by default. Any number of readers in any\n"
+        "process get the newest sample from spipy.read_sample() without\n"
+        "touching the bus. Returns the name.\n");
+
+static PyObject *SPI_start_sampler(SPI *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *obj, *seq, *keep = Py_None;
+    struct spi_sampler *sp;
+    struct spi_sample *out;
+    const char *name = NULL;
+    double interval;
+    int rx_length = 0, tx_length, len, fd, err;
+    static char *kwlist[] = { "values", "interval", "rx_length", "keep",
+            "name", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Od|iOz:start_sampler",
+            kwlist, &obj, &interval, &rx_length, &keep, &name))
+        return NULL;
+
+    if (self->bus < 0)
+    {
+        PyErr_SetString(SpiError, "not open");
+        return NULL;
+    }
+    if (self->sampler != NULL)
+    {
+        PyErr_SetString(SpiError, "sampler already running");
+        return NULL;
+    }
+    if (interval <= 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "interval must be positive");
+        return NULL;
+    }
+
+    if ((seq = PySequence_Fast(obj, "Expected a sequence type")) == NULL)
+        return NULL;
+    tx_length = PySequence_Fast_GET_SIZE(seq);
+    if (tx_length > MAX_TRANSFER_LENGTH || rx_length > MAX_TRANSFER_LENGTH)
+    {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_OverflowError, "Transfer is too long");
+        return NULL;
+    }
+    if ((sp = calloc(1, sizeof(*sp))) == NULL)
+    {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    if (spi_seq_to_buf(seq, sp->tx) < 0)
+    {
+        Py_DECREF(seq);
+        free(sp);
+        return NULL;
+    }
+    Py_DECREF(seq);
+
+    len = tx_length > rx_length ? tx_length : rx_length;
+    sp->keep_length = -1;
+    if (keep != Py_None
+            && (sp->keep_length = spi_parse_keep(keep, len, sp->keep_idx)) < 0)
+    {
+        free(sp);
+        return NULL;
+    }
+
+    if (name == NULL)
+        snprintf(sp->name, PUB_NAME_MAX, "/spipy-sample-%d.%d-%d", self->bus,
+                self->device, (int) getpid());
+    else if (snprintf(sp->name, PUB_NAME_MAX, "%s", name) >= PUB_NAME_MAX)
+    {
+        free(sp);
+        PyErr_SetString(PyExc_ValueError, "name is too long");
+        return NULL;
+    }
+
+    if ((fd = shm_open(sp->name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, sp->name);
+        free(sp);
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(*out)) == -1
+            || (out = mmap(NULL, sizeof(*out), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, sp->name);
+        close(fd);
+        shm_unlink(sp->name);
+        free(sp);
+        return NULL;
+    }
+    close(fd);
+
+    out->version = SAMPLE_VERSION;
+    out->size = sizeof(*out);
+    out->pid = getpid();
+    out->bus = self->bus;
+    out->device = self->device;
+    out->len = sp->keep_length >= 0 ? sp->keep_length : len;
+    __sync_synchronize();
+    out->magic = SAMPLE_MAGIC;
+
+    sp->shm = out;
+    sp->interval_ns = interval * 1e9;
+    sp->xfer.tx_buf = (unsigned long) sp->tx;
+    sp->xfer.rx_buf = (unsigned long) sp->rx;
+    sp->xfer.len = len;
+    sp->xfer.delay_usecs = TRANSFER_DELAY_USECS;
+    sp->xfer.speed_hz = self->speed;
+    sp->xfer.bits_per_word = TRANSFER_BITS;
+    self->sampler = sp;
+
+    if ((err = pthread_create(&sp->thread, NULL, spi_sampler_run, self)) != 0)
+    {
+        self->sampler = NULL;
+        munmap(out, sizeof(*out));
+        shm_unlink(sp->name);
+        free(sp);
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    return PyString_FromString(sp->name);
+}
+
+PyDoc_STRVAR(SPI_stop_sampler_doc,
+        "stop_sampler()\n\n"
+        "Stop the thread start_sampler() started and remove its shared\n"
+        "memory. close() does this too.\n");
+
+static PyObject *SPI_stop_sampler_method(SPI *self)
+{
+    SPI_stop_sampler(self);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(SPI_set_mode_doc,
+        "set_mode(mode) -> mode\n\n"
+        "Set the SPI mode: clock phase and polarity and the other SPI_*\n"
+        "flags, including the SPI_TX_DUAL/QUAD and SPI_RX_DUAL/QUAD bus\n"
+        "widths the wiring supports. Returns the mode the driver took.\n");
+
+static PyObject *SPI_set_mode(SPI *self, PyObject *args)
+{
+    uint32_t mode, cur;
+    uint8_t mode8;
+
+    if (!PyArg_ParseTuple(args, "I:set_mode", &mode))
+        return NULL;
+
+    if (self->broker != NULL)
+    {
+        PyErr_SetString(SpiError, "the broker sets the mode");
+        return NULL;
+    }
+    if (!self->mock)
+    {
+        if (self->fd < 0)
+        {
+            PyErr_SetString(SpiError, "not open");
+            return NULL;
+        }
+        /*
+         * Another process may have changed the mode since this one last
+         * looked, so ask the driver rather than remembering. Reading is
+         * cheap; a write makes the controller driver set up again.
+         */
+        if (spi_read_mode(self->fd, &cur) == 0 && cur == mode)
+        {
+            self->mode = mode;
+            return PyLong_FromUnsignedLong(self->mode);
+        }
+
+        mode8 = mode;
+        if (ioctl(self->fd, SPI_IOC_WR_MODE32, &mode) == -1
+                && (mode > 0xff || ioctl(self->fd, SPI_IOC_WR_MODE, &mode8) == -1))
+            return PyErr_SetFromErrno(PyExc_IOError);
+        if (spi_read_mode(self->fd, &mode) < 0)
+            return PyErr_SetFromErrno(PyExc_IOError);
+    }
+    self->mode = mode;
+
+    return PyLong_FromUnsignedLong(self->mode);
+}
+
+PyDoc_STRVAR(SPI_get_mode_doc,
+        "get_mode() -> mode\n\n"
+        "Return the SPI mode read when the device was opened, or last\n"
+        "set with set_mode().\n");
+
+static PyObject *SPI_get_mode(SPI *self)
+{
+    return PyLong_FromUnsignedLong(self->mode);
+}
+
+PyDoc_STRVAR(SPI_flash_read_doc,
+        "flash_read(address, nbytes, protocol=None, addr_bytes=3)\n"
+        "    -> bytearray\n\n"
+        "Read nbytes of SPI NOR flash from address with a fast read\n"
+        "command: protocol \"1-1-1\" (0Bh), \"1-1-2\" (3Bh), \"1-1-4\"\n"
+        "(6Bh) or \"1-4-4\" (EBh), giving the wires used for command,\n"
+        "address and data. The default is the widest the mode allows.\n"
+        "With addr_bytes=4 the 4 byte address opcodes are used.\n");
+
+static PyObject *SPI_flash_read(SPI *self, PyObject *args, PyObject *kwds)
+{
+    struct spi_prefix prefix;
+    const char *protocol = NULL;
+    unsigned long address;
+    Py_ssize_t nbytes, off;
+    PyObject *out;
+    unsigned char *buf;
+    size_t chunk, len;
+    int addr_bytes = 3, ret = 0;
+    static char *kwlist[] = { "address", "nbytes", "protocol", "addr_bytes",
+            NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "kn|zi:flash_read", kwlist,
+            &address, &nbytes, &protocol, &addr_bytes))
+        return NULL;
+    if (nbytes < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "nbytes must not be negative");
+        return NULL;
+    }
+    if (spi_flash_protocol(self, &prefix, protocol, address, addr_bytes) < 0)
+        return NULL;
+    if ((out = PyByteArray_FromStringAndSize(NULL, nbytes)) == NULL)
+        return NULL;
+    buf = (unsigned char *) PyByteArray_AS_STRING(out);
+    chunk = SPI_bulk_chunk(self, spi_prefix_len(&prefix), 0);
+
+    SPI_BEGIN_ALLOW_THREADS(self)
+    ret = SPI_flush(self);
+    for (off = 0; ret >= 0 && off < nbytes; off += len)
+    {
+        len = (size_t) (nbytes - off) < chunk ? (size_t) (nbytes - off) : chunk;
+        ret = SPI_chunk(self, &prefix, NULL, buf + off, len);
+    }
+    SPI_END_ALLOW_THREADS(self)
+
+    if (ret < 0)
+    {
+        Py_DECREF(out);
+        return PyErr_SetFromErrno(PyExc_IOError);
+    }
+    return out;
+}
+
+PyDoc_STRVAR(SPI_set_faults_doc,
+        "set_faults(seed=0, error_rate=0, errnos=(EIO,), flip_rate=0,\n"
+        "           latency_usec=0, latency_rate=0, busy_rate=0,\n"
+        "           busy_messages=1, busy_mask=0x01)\n\n"
+        "Make a mock handle misbehave, for seeing how code copes with a\n"
+        "bad bus. Each message fails with one of errnos with probability\n"
+        "error_rate, is held up latency_usec with probability\n"
+        "latency_rate, and with probability busy_rate starts a spell of\n"
+        "busy_messages replies with busy_mask set in their first byte.\n"
+        "Each byte received has a random bit flipped with probability\n"
+        "flip_rate. All draws come from seed, so a single threaded run\n"
+        "repeats exactly. set_faults() with no rates turns faults off;\n"
+        "stats() counts what was injected.\n");
+
+static PyObject *SPI_set_faults(SPI *self, PyObject *args, PyObject *kwds)
+{
+    struct spi_faults *f, conf;
+    PyObject *errnos = Py_None, *seq;
+    unsigned long long seed = 0;
+    double latency_usec = 0;
+    Py_ssize_t i;
+    static char *kwlist[] = { "seed", "error_rate", "errnos", "flip_rate",
+            "latency_usec", "latency_rate", "busy_rate", "busy_messages",
+            "busy_mask", NULL };
+
+    if (!self->mock)
+    {
+        PyErr_SetString(SpiError, "faults need a handle opened with mock=True");
+        return NULL;
+    }
+
+    memset(&conf, 0, sizeof(conf));
+    conf.busy_messages = 1;
+    conf.busy_mask = 0x01;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|KdOddddIB:set_faults",
+            kwlist, &seed, &conf.error_rate, &errnos, &conf.flip_rate,
+            &latency_usec, &conf.latency_rate, &conf.busy_rate,
+            &conf.busy_messages, &conf.busy_mask))
+        return NULL;
+
+    if (errnos == Py_None)
+        conf.errnos[conf.nerrnos++] = EIO;
+    else
+    {
+        if ((seq = PySequence_Fast(errnos, "errnos must be a sequence")) == NULL)
+            return NULL;
+        for (i = 0; i < PySequence_Fast_GET_SIZE(seq) && conf.nerrnos < FAULT_MAX_ERRNOS; i++)
+        {
+            conf.errnos[conf.nerrnos] = PyInt_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+            if (PyErr_Occurred())
+                break;
+            /* a failed message must look like one to the caller */
+            if (conf.errnos[conf.nerrnos++] <= 0)
+            {
+                PyErr_SetString(PyExc_ValueError, "errnos must be positive");
+                break;
+            }
+        }
+        if (!PyErr_Occurred() && (conf.nerrnos == 0
+                || i < PySequence_Fast_GET_SIZE(seq)))
+            PyErr_Format(PyExc_ValueError, "errnos takes 1 to %d values",
+                    FAULT_MAX_ERRNOS);
+        Py_DECREF(seq);
+        if (PyErr_Occurred())
+            return NULL;
+    }
+
+    /* kept until close(), other threads may be sending */
+    if ((f = self->faults) == NULL)
+    {
+        if ((f = calloc(1, sizeof(*f))) == NULL)
+            return PyErr_NoMemory();
+        pthread_mutex_init(&f->lock, NULL);
+    }
+
+    pthread_mutex_lock(&f->lock);
+    f->rng = seed;
+    f->error_rate = conf.error_rate;
+    memcpy(f->errnos, conf.errnos, sizeof(f->errnos));
+    f->nerrnos = conf.nerrnos;
+    f->flip_rate = conf.flip_rate;
+    f->latency_rate = conf.latency_rate;
+    f->latency_ns = latency_usec * 1000;
+    f->busy_rate = conf.busy_rate;
+    f->busy_messages = conf.busy_messages;
+    f->busy_left = 0;
+    f->busy_mask = conf.busy_mask;
+    pthread_mutex_unlock(&f->lock);
+    self->faults = f;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(SPI_set_rate_limit_doc,
+        "set_rate_limit(bytes_per_sec=0, transfers_per_sec=0,\n"
+        "               byte_burst=0, transfer_burst=0)\n\n"
+        "Limit this handle with token buckets. Messages wait before they\n"
+        "are sent until both buckets admit them. A rate of 0 removes that\n"
+        "limit. Bursts default to a tenth of a second at the given rate.\n");
+
+static PyObject *SPI_set_rate_limit(SPI *self, PyObject *args, PyObject *kwds)
+{
+    double byte_rate = 0, xfer_rate = 0, byte_burst = 0, xfer_burst = 0;
+    static char *kwlist[] = { "bytes_per_sec", "transfers_per_sec",
+            "byte_burst", "transfer_burst", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dddd:set_rate_limit",
+            kwlist, &byte_rate, &xfer_rate, &byte_burst, &xfer_burst))
+        return NULL;
+
+    if (byte_rate < 0 || xfer_rate < 0 || byte_burst < 0 || xfer_burst < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "rate limits must not be negative");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&self->lock);
+    spi_bucket_set(&self->byte_bucket, byte_rate, byte_burst);
+    spi_bucket_set(&self->xfer_bucket, xfer_rate, xfer_burst);
+    pthread_mutex_unlock(&self->lock);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(SPI_transfer_verify_doc,
+        "transfer_verify(values, expected, mask=None, max_report=16)\n"
+        "    -> (mismatches, (offsets))\n\n"
+        "Send values and compare what comes back against expected, only\n"
+        "looking at the bits set in mask if one is given. Returns how many\n"
+        "bytes differed and the offsets of the first max_report of them.\n"
+        "Any length may be sent; it goes out in bufsiz chunks, or broker\n"
+        "slot sized ones through a broker. All three arguments take\n"
+        "sequences or buffer protocol objects.\n");
+
+static PyObject *SPI_transfer_verify(SPI *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *tx_obj, *exp_obj, *mask_obj = Py_None;
+    PyObject *ret_obj = NULL, *list;
+    struct spi_bytes tx, expected, mask;
+    struct spi_ioc_transfer xfer;
+    size_t *offsets = NULL, noffsets = 0, mismatches = 0;
+    size_t off, len, chunk, alloc;
+    Py_ssize_t max_report = 16, i;
+    unsigned char *rx;
+    int ret = 0;
+    static char *kwlist[] = { "values", "expected", "mask", "max_report", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|On:transfer_verify",
+            kwlist, &tx_obj, &exp_obj, &mask_obj, &max_report))
+        return NULL;
+
+    if (max_report < 0)
+        max_report = 0;
+
+    memset(&mask, 0, sizeof(mask));
+    if (spi_bytes_get(tx_obj, &tx) < 0)
+        return NULL;
+    if (spi_bytes_get(exp_obj, &expected) < 0)
+        goto out_tx;
+    if (mask_obj != Py_None && spi_bytes_get(mask_obj, &mask) < 0)
+        goto out_expected;
+
+    if (expected.len != tx.len || (mask.buf != NULL && mask.len != tx.len))
+    {
+        PyErr_SetString(PyExc_ValueError,
+                "values, expected and mask must be the same length");
+        goto out;
+    }
+
+    chunk = SPI_message_max(self);
+    alloc = chunk;
+    if ((rx = spi_arena_alloc(&alloc, 0)) == NULL
+            || (offsets = malloc((max_report ? max_report : 1) * sizeof(*offsets))) == NULL)
+    {
+        spi_arena_free(rx, alloc);
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    SPI_BEGIN_ALLOW_THREADS(self)
+    ret = SPI_flush(self);
+    for (off = 0; ret >= 0 && off < (size_t) tx.len; off += len)
+    {
+        len = tx.len - off < chunk ? tx.len - off : chunk;
+
+        memset(&xfer, 0, sizeof(xfer));
+        xfer.tx_buf = (unsigned long) (tx.buf + off);
+        xfer.rx_buf = (unsigned long) rx;
+        xfer.len = len;
+        xfer.delay_usecs = TRANSFER_DELAY_USECS;
+        xfer.speed_hz = self->speed;
+        xfer.bits_per_word = TRANSFER_BITS;
+        if ((ret = SPI_message(self, &xfer, 1)) < 0)
+            break;
+
+        mismatches += spi_verify_block(rx, expected.buf + off,
+                mask.buf ? mask.buf + off : NULL, len, off, offsets,
+                &noffsets, max_report);
+    }
+    SPI_END_ALLOW_THREADS(self)
+    spi_arena_free(rx, alloc);
+
+    if (ret < 0)
+    {
+        PyErr_SetFromErrno(PyExc_IOError);
+        goto out;
+    }
+
+    if ((list = PyTuple_New(noffsets)) == NULL)
+        goto out;
+    for (i = 0; i < (Py_ssize_t) noffsets; i++)
+        PyTuple_SET_ITEM(list, i, PyInt_FromSsize_t(offsets[i]));
+    ret_obj = Py_BuildValue("(nN)", (Py_ssize_t) mismatches, list);
+
+out:
+    free(offsets);
+    spi_bytes_release(&mask);
+out_expected:
+    spi_bytes_release(&expected);
+out_tx:
+    spi_bytes_release(&tx);
+    return ret_obj;
+}
+
+/*
+ * A new uint8[rows, row_length] numpy array when numpy is already loaded,
+ * so spipy doesn't need it to build, else a bytearray.
+ */
+static PyObject *spi_batch_out(Py_ssize_t rows, Py_ssize_t row_length)
+{
+    PyObject *numpy = PyDict_GetItemString(PyImport_GetModuleDict(), "numpy");
+
+    if (numpy != NULL)
+        return PyObject_CallMethod(numpy, "zeros", "((nn)s)", rows, row_length,
+                "uint8");
+    return PyByteArray_FromStringAndSize(NULL, rows * row_length);
+}
+
+PyDoc_STRVAR(SPI_transfer_batch_doc,
+        "transfer_batch(values, cs_change=True, out=None, row_length=0)\n"
+        "    -> out\n\n"
+        "Send each row of values, a C contiguous uint8[N, L] buffer such\n"
+        "as a numpy array, as one segment, and return what came back as\n"
+        "uint8[N, L]: in out if given, else in a new numpy array when\n"
+        "numpy is loaded, else a bytearray. Rows go out in as few\n"
+        "messages as bufsiz allows, or a broker slot on a broker handle;\n"
+        "with cs_change the chip select is released between rows, as if\n"
+        "each were its own transfer().\n"
+        "One dimensional buffers such as bytes are split into rows of\n"
+        "row_length.\n");
+
+static PyObject *SPI_transfer_batch(SPI *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *tx_obj, *out_obj = Py_None;
+    Py_buffer tx, rx;
+    struct spi_ioc_transfer xfer[BATCH_MAX_ENTRIES];
+    Py_ssize_t rows, row_length = 0, row, i, n, max_rows = BATCH_MAX_ENTRIES;
+    size_t bytes, max_bytes = SPI_message_max(self);
+    int cs_change = 1, ret = 0;
+    static char *kwlist[] = { "values", "cs_change", "out", "row_length", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iOn:transfer_batch",
+            kwlist, &tx_obj, &cs_change, &out_obj, &row_length))
+        return NULL;
+
+    if (PyObject_GetBuffer(tx_obj, &tx, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+        return NULL;
+    if (tx.itemsize != 1)
+    {
+        PyErr_SetString(PyExc_TypeError, "values must be a buffer of bytes");
+        goto out_tx;
+    }
+    if (tx.ndim == 2)
+        row_length = tx.shape[1];
+    if (row_length <= 0 || tx.len % row_length != 0)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                "values must be 2-D, or row_length must divide its length");
+        goto out_tx;
+    }
+    rows = tx.len / row_length;
+    if (self->broker != NULL)
+        max_rows = BROKER_MAX_SEGS;
+
+    if (out_obj == Py_None)
+    {
+        if ((out_obj = spi_batch_out(rows, row_length)) == NULL)
+            goto out_tx;
+    }
+    else
+        Py_INCREF(out_obj);
+    if (PyObject_GetBuffer(out_obj, &rx, PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE) < 0)
+        goto out_obj;
+    if (rx.len != tx.len)
+    {
+        PyErr_SetString(PyExc_ValueError, "out must be the same size as values");
+        goto out_rx;
+    }
+
+    SPI_BEGIN_ALLOW_THREADS(self)
+    ret = SPI_flush(self);
+    if (ret == 0)
+        ret = SPI_tune_refresh(self);
+    for (row = 0; ret >= 0 && row < rows; row += n)
+    {
+        memset(xfer, 0, sizeof(xfer));
+        for (n = 0, bytes = 0; row + n < rows && n < max_rows; n++)
+        {
+            /* always take one row, spidev reports it if it's too big */
+            if (n > 0 && bytes + row_length > max_bytes)
+                break;
+            i = row + n;
+            xfer[n].tx_buf = (unsigned long) ((unsigned char *) tx.buf + i * row_length);
+            xfer[n].rx_buf = (unsigned long) ((unsigned char *) rx.buf + i * row_length);
+            xfer[n].len = row_length;
+            xfer[n].delay_usecs = TRANSFER_DELAY_USECS;
+            xfer[n].speed_hz = self->speed;
+            xfer[n].bits_per_word = TRANSFER_BITS;
+            if (n > 0)
+                xfer[n - 1].cs_change = cs_change; /* between rows only */
+            bytes += row_length;
+        }
+        ret = SPI_message(self, xfer, n);
+    }
+    SPI_END_ALLOW_THREADS(self)
+
+    if (ret < 0)
+    {
+        PyErr_SetFromErrno(PyExc_IOError);
+        goto out_rx;
+    }
+
+    PyBuffer_Release(&rx);
+    PyBuffer_Release(&tx);
+    return out_obj;
+
+out_rx:
+    PyBuffer_Release(&rx);
+out_obj:
+    Py_DECREF(out_obj);
+out_tx:
+    PyBuffer_Release(&tx);
+    return NULL;
+}
+
+PyDoc_STRVAR(SPI_read_to_fd_doc,
+        "read_to_fd(fd, nbytes, cmd_prefix=None, chunk=0, address=-1,\n"
+        "           addr_bytes=3, offset=-1, direct=False, progress=None,\n"
+        "           progress_every=1048576, protocol=None) -> nbytes\n\n"
+        "Read nbytes from the device and write them to fd, a file\n"
+        "descriptor or an object with fileno(), without going through\n"
+        "Python. Data is read in chunks of at most bufsiz bytes, each one\n"
+        "preceded by cmd_prefix and, when address >= 0, by an addr_bytes\n"
+        "address that advances with the data. One buffer is filled over\n"
+        "SPI while the other is written out. With offset >= 0 data goes\n"
+        "to that file offset with pwrite(). direct sets O_DIRECT while\n"
+        "writing, and needs chunk, when given, and the offset, or the\n"
+        "file position, to be multiples of 512. The file status flags\n"
+        "are restored after.\n"
+        "progress(bytes_done) is called every progress_every bytes.\n"
+        "protocol reads SPI NOR flash from address instead of sending\n"
+        "cmd_prefix, see flash_read().\n");
+
+static PyObject *SPI_read_to_fd(SPI *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *fd_obj, *cmd = Py_None, *progress = Py_None, *res;
+    struct spi_prefix prefix;
+    struct spi_pipe pipe;
+    struct spi_fd_writer writer;
+    pthread_t thread;
+    unsigned long long nbytes, done = 0, next_report;
+    unsigned long long chunk = 0, progress_every = PROGRESS_EVERY;
+    long long address = -1, offset = -1, pos;
+    int addr_bytes = 3, direct = 0, fd, fl = 0, i = 0, ret = 0;
+    unsigned char *buf;
+    size_t len;
+    const char *protocol = NULL;
+    static char *kwlist[] = { "fd", "nbytes", "cmd_prefix", "chunk",
+            "address", "addr_bytes", "offset", "direct", "progress",
+            "progress_every", "protocol", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OK|OKLiLiOKz:read_to_fd",
+            kwlist, &fd_obj, &nbytes, &cmd, &chunk, &address, &addr_bytes,
+            &offset, &direct, &progress, &progress_every, &protocol))
+        return NULL;
+
+    if ((fd = PyObject_AsFileDescriptor(fd_obj)) < 0)
+        return NULL;
+    if (progress != Py_None && !PyCallable_Check(progress))
+    {
+        PyErr_SetString(PyExc_TypeError, "progress must be callable");
+        return NULL;
+    }
+    if (protocol != NULL)
+    {
+        if (cmd != Py_None || address < 0)
+        {
+            PyErr_SetString(PyExc_ValueError,
+                    "protocol takes an address and no cmd_prefix");
+            return NULL;
+        }
+        if (spi_flash_protocol(self, &prefix,
+                strcmp(protocol, "auto") == 0 ? NULL : protocol, address,
+                addr_bytes) < 0)
+            return NULL;
+    }
+    else if (spi_prefix_init(&prefix, cmd, address, addr_bytes) < 0)
+        return NULL;
+
+    /* an unaligned O_DIRECT write fails after data has left the device */
+    pos = offset >= 0 ? offset : lseek(fd, 0, SEEK_CUR);
+    if (direct && (pos < 0 || pos % DIRECT_ALIGN != 0))
+    {
+        PyErr_Format(PyExc_ValueError,
+                "direct needs a file offset aligned to %d bytes", DIRECT_ALIGN);
+        return NULL;
+    }
+    /* whole blocks per chunk, or the writer drops O_DIRECT after one */
+    if (direct && chunk % DIRECT_ALIGN != 0)
+    {
+        PyErr_Format(PyExc_ValueError,
+                "direct needs a chunk that is a multiple of %d bytes",
+                DIRECT_ALIGN);
+        return NULL;
+    }
+
+    chunk = SPI_bulk_chunk(self, spi_prefix_len(&prefix), chunk);
+    /* the default, or what fits in one message, is cut to whole blocks */
+    if (direct)
+    {
+        chunk -= chunk % DIRECT_ALIGN;
+        if (chunk == 0)
+        {
+            PyErr_Format(PyExc_ValueError,
+                    "direct needs messages of at least %d bytes", DIRECT_ALIGN);
+            return NULL;
+        }
+    }
+    if (progress_every == 0)
+        progress_every = PROGRESS_EVERY;
+
+    if (spi_pipe_init(&pipe, chunk) < 0)
+        return PyErr_SetFromErrno(PyExc_IOError);
+
+    if (direct)
+    {
+        fl = fcntl(fd, F_GETFL);
+        if (fl == -1 || fcntl(fd, F_SETFL, fl | O_DIRECT) == -1)
+        {
+            spi_pipe_destroy(&pipe);
+            return PyErr_SetFromErrno(PyExc_IOError);
+        }
+    }
+
+    writer.pipe = &pipe;
+    writer.fd = fd;
+    writer.offset = offset;
+    writer.direct = direct;
+    if ((errno = pthread_create(&thread, NULL, spi_fd_writer_run, &writer)) != 0)
+    {
+        if (direct)
+            fcntl(fd, F_SETFL, fl);
+        spi_pipe_destroy(&pipe);
+        return PyErr_SetFromErrno(PyExc_IOError);
+    }
+
+    while (done < nbytes && ret >= 0)
+    {
+        next_report = done + progress_every;
+
+        SPI_BEGIN_ALLOW_THREADS(self)
+        ret = SPI_flush(self);
+        if (ret == 0)
+            ret = SPI_tune_refresh(self);
+        while (ret >= 0 && done < nbytes && done < next_report)
+        {
+            if ((buf = spi_pipe_get_empty(&pipe, i)) == NULL)
+            {
+                ret = -1;
+                errno = pipe.error;
+                break;
+            }
+            len = nbytes - done < chunk ? nbytes - done : chunk;
+            if ((ret = SPI_chunk(self, &prefix, NULL, buf, len)) < 0)
+            {
+                spi_pipe_fail(&pipe, errno);
+                break;
+            }
+            spi_pipe_put(&pipe, i, len);
+            done += len;
+            i ^= 1;
+        }
+        SPI_END_ALLOW_THREADS(self)
+
+        if (ret >= 0 && progress != Py_None)
+        {
+            if ((res = PyObject_CallFunction(progress, "K", done)) == NULL)
+            {
+                spi_pipe_fail(&pipe, ECANCELED);
+                ret = -2;
+            }
+            Py_XDECREF(res);
+        }
+        if (ret >= 0 && PyErr_CheckSignals() < 0)
+        {
+            spi_pipe_fail(&pipe, EINTR);
+            ret = -2;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    spi_pipe_eof(&pipe);
+    pthread_join(thread, NULL);
+    Py_END_ALLOW_THREADS
+
+    if (direct)
+        fcntl(fd, F_SETFL, fl);
+    if (ret == -1 || (ret >= 0 && pipe.error))
+    {
+        errno = pipe.error ? pipe.error : errno;
+        spi_pipe_destroy(&pipe);
+        return PyErr_SetFromErrno(PyExc_IOError);
+    }
+    spi_pipe_destroy(&pipe);
+    if (ret == -2)
+        return NULL; /* callback or signal raised */
+
+    return PyLong_FromUnsignedLongLong(done);
+}
+
+PyDoc_STRVAR(SPI_write_from_fd_doc,
+        "write_from_fd(fd, offset=0, length=-1, cmd_prefix=None, chunk=0,\n"
+        "              address=-1, addr_bytes=3, progress=None,\n"
+        "              progress_every=1048576) -> nbytes\n\n"
+        "Send length bytes of fd, starting at offset, to the device; -1\n"
+        "sends everything up to the end of the file. Regular files are\n"
+        "mapped and sent straight from the page cache; anything else is\n"
+        "read ahead by a second thread into two alternating buffers.\n"
+        "Each chunk of at most bufsiz bytes is preceded by cmd_prefix\n"
+        "and, when address >= 0, an addr_bytes address that advances\n"
+        "with the data, e.g. cmd_prefix=(0x02,), chunk=256 for page\n"
+        "programming. progress(bytes_done) is called every\n"
+        "progress_every bytes. A pipe or socket is sent from where it\n"
+        "is, so offset must be 0 for one.\n");
+
+static PyObject *SPI_write_from_fd(SPI *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *fd_obj, *cmd = Py_None, *progress = Py_None;
+    struct spi_upload up;
+    struct spi_pipe pipe;
+    struct spi_fd_reader reader;
+    struct stat st;
+    pthread_t thread;
+    long long offset = 0, length = -1, address = -1, sent;
+    unsigned long long chunk = 0, progress_every = PROGRESS_EVERY;
+    int addr_bytes = 3, fd;
+    size_t page = sysconf(_SC_PAGESIZE), skew;
+    void *map;
+    static char *kwlist[] = { "fd", "offset", "length", "cmd_prefix", "chunk",
+            "address", "addr_bytes", "progress", "progress_every", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|LLOKLiOK:write_from_fd",
+            kwlist, &fd_obj, &offset, &length, &cmd, &chunk, &address,
+            &addr_bytes, &progress, &progress_every))
+        return NULL;
+
+    if ((fd = PyObject_AsFileDescriptor(fd_obj)) < 0)
+        return NULL;
+    if (offset < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "offset must not be negative");
+        return NULL;
+    }
+    /* a pipe or socket is read from wherever it is */
+    if (offset != 0 && lseek(fd, 0, SEEK_CUR) == -1 && errno == ESPIPE)
+    {
+        PyErr_SetString(PyExc_ValueError, "offset needs a seekable fd");
+        return NULL;
+    }
+    if (SPI_upload_init(self, &up, cmd, chunk, address, addr_bytes, progress,
+            progress_every) < 0)
+        return NULL;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        if (offset > st.st_size)
+            offset = st.st_size;
+        if (length < 0 || length > st.st_size - offset)
+            length = st.st_size - offset;
+        if (length == 0)
+            return PyInt_FromLong(0);
+
+        skew = offset % page;
+        map = mmap(NULL, length + skew, PROT_READ, MAP_SHARED, fd, offset - skew);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, length + skew, MADV_SEQUENTIAL);
+            madvise(map, length + skew, MADV_WILLNEED);
+            up.base = (unsigned char *) map + skew;
+            up.len = length;
+            sent = SPI_upload(self, &up);
+            munmap(map, length + skew);
+            return sent < 0 ? NULL : PyLong_FromLongLong(sent);
+        }
+    }
+
+    /* not mappable: a pipe, socket or character device */
+    if (spi_pipe_init(&pipe, up.chunk) < 0)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    up.pipe = &pipe;
+
+    reader.pipe = &pipe;
+    reader.fd = fd;
+    reader.offset = lseek(fd, 0, SEEK_CUR) == -1 ? -1 : offset;
+    reader.remaining = length < 0 ? ~0ULL : (unsigned long long) length;
+    if ((errno = pthread_create(&thread, NULL, spi_fd_reader_run, &reader)) != 0)
+    {
+        spi_pipe_destroy(&pipe);
+        return PyErr_SetFromErrno(PyExc_IOError);
+    }
+
+    sent = SPI_upload(self, &up);
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_join(thread, NULL);
+    Py_END_ALLOW_THREADS
+    spi_pipe_destroy(&pipe);
+    return sent < 0 ? NULL : PyLong_FromLongLong(sent);
+}
+
+PyDoc_STRVAR(SPI_write_from_mmap_doc,
+        "write_from_mmap(data, cmd_prefix=None, chunk=0, address=-1,\n"
+        "                addr_bytes=3, progress=None,\n"
+        "                progress_every=1048576) -> nbytes\n\n"
+        "Like write_from_fd(), but sends an object supporting the buffer\n"
+        "protocol, such as an mmap.mmap, directly from its memory.\n");
+
+static PyObject *SPI_write_from_mmap(SPI *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *data, *cmd = Py_None, *progress = Py_None;
+    struct spi_upload up;
+    struct spi_bytes b;
+    long long address = -1, sent;
+    unsigned long long chunk = 0, progress_every = PROGRESS_EVERY;
+    int addr_bytes = 3;
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start;
+    static char *kwlist[] = { "data", "cmd_prefix", "chunk", "address",
+            "addr_bytes", "progress", "progress_every", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OKLiOK:write_from_mmap",
+            kwlist, &data, &cmd, &chunk, &address, &addr_bytes, &progress,
+            &progress_every))
+        return NULL;
+
+    if (SPI_upload_init(self, &up, cmd, chunk, address, addr_bytes, progress,
+            progress_every) < 0)
+        return NULL;
+    if (!PyObject_CheckBuffer(data) && !PyObject_CheckReadBuffer(data))
+    {
+        PyErr_SetString(PyExc_TypeError, "data must support the buffer protocol");
+        return NULL;
+    }
+    if (spi_bytes_get(data, &b) < 0)
+        return NULL;
+
+    if (b.len > 0)
+    {
+        /* harmless if this isn't a mapping, it only tunes read-ahead */
+        start = (uintptr_t) b.buf & ~(uintptr_t) (page - 1);
+        madvise((void *) start, (uintptr_t) b.buf + b.len - start,
+                MADV_SEQUENTIAL);
+        madvise((void *) start, (uintptr_t) b.buf + b.len - start,
+                MADV_WILLNEED);
+    }
+
+    up.base = b.buf;
+    up.len = b.len;
+    sent = SPI_upload(self, &up);
+    spi_bytes_release(&b);
+    return sent < 0 ? NULL : PyLong_FromLongLong(sent);
+}
+
+PyDoc_STRVAR(SPI_write_doc,
+        "write([values])\n\n"
+        "Perform a write-only SPI transaction, discarding what the device\n"
+        "sends back. Objects supporting the buffer protocol, such as an\n"
+        "SPIBuffer, are sent without being copied. In autobatch mode\n"
+        "the write may be queued and sent later together with others,\n"
+        "but always before the next transfer.\n");
+
+static PyObject *SPI_write(SPI *self, PyObject *args)
+{
+    PyObject *obj, *seq;
+    unsigned char tx_buf[MAX_TRANSFER_LENGTH];
+    unsigned char *buf = tx_buf;
+    Py_buffer view;
+    Py_ssize_t len;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "O:write", &obj))
+        return NULL;
+
+    if (PyObject_CheckBuffer(obj))
+    {
+        /* SPIBuffer, bytearray, array...: send straight from its memory */
+        if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) < 0)
+            return NULL;
+
+        SPI_BEGIN_ALLOW_THREADS(self)
+        ret = SPI_write_buf(self, view.buf, view.len);
+        SPI_END_ALLOW_THREADS(self)
+        PyBuffer_Release(&view);
+    }
+    else
+    {
+        if ((seq = PySequence_Fast(obj, "Expected a sequence type")) == NULL)
+            return NULL;
+
+        len = PySequence_Fast_GET_SIZE(seq);
+        if (len > MAX_TRANSFER_LENGTH && (buf = malloc(len)) == NULL)
+        {
+            Py_DECREF(seq);
+            return PyErr_NoMemory();
+        }
+        if (spi_seq_to_buf(seq, buf) < 0)
+        {
+            Py_DECREF(seq);
+            if (buf != tx_buf)
+                free(buf);
+            return NULL;
+        }
+        Py_DECREF(seq);
+
+        SPI_BEGIN_ALLOW_THREADS(self)
+        ret = SPI_write_buf(self, buf, len);
+        SPI_END_ALLOW_THREADS(self)
+        if (buf != tx_buf)
+            free(buf);
+    }
+
+    if (ret < 0)
+    {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(SPI_flush_doc,
+        "flush()\n\n"
+        "Send any writes queued in autobatch mode now.\n");
+
+static PyObject *SPI_flush_method(SPI *self)
+{
+    int ret;
+
+    SPI_BEGIN_ALLOW_THREADS(self)
+    ret = SPI_flush(self);
+    SPI_END_ALLOW_THREADS(self)
+    if (ret < 0)
+    {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(SPI_set_autobatch_doc,
+        "set_autobatch(max_entries, max_usecs)\n\n"
+        "Queue write() calls and send them as one message once\n"
+        "max_entries are waiting or the oldest has waited max_usecs,\n"
+        "whichever comes first. transfer() and run() send the queue\n"
+        "before reading anything. max_entries 0 turns batching off.\n"
+        "On a broker handle a batch is capped at what one broker slot\n"
+        "carries. While another thread holds lock(), the queue waits\n"
+        "for that thread's next read or for unlock(). Writes in other\n"
+        "threads are waited for before the old queue is replaced.\n");
+
+static PyObject *SPI_set_autobatch(SPI *self, PyObject *args)
+{
+    struct spi_batch *old, *batch = NULL;
+    unsigned int max_entries;
+    unsigned long long usecs = 0;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "I|K:set_autobatch", &max_entries, &usecs))
+        return NULL;
+
+    if (max_entries > BATCH_MAX_ENTRIES)
+    {
+        PyErr_Format(PyExc_ValueError, "at most %d entries can be batched",
+                BATCH_MAX_ENTRIES);
+        return NULL;
+    }
+
+    if (self->swapping)
+    {
+        PyErr_SetString(SpiError, "another thread is replacing the handle's state");
+        return NULL;
+    }
+
+    /* writers still inside SPI_write_buf() may be using the old batch */
+    self->swapping = 1;
+    old = self->batch;
+    self->batch = NULL;
+    SPI_quiesce(self);
+
+    SPI_BEGIN_ALLOW_THREADS(self)
+    ret = spi_batch_stop(self, old);
+    if (ret == 0 && max_entries > 0
+            && (batch = spi_batch_start(self, max_entries, usecs * 1000)) == NULL)
+        ret = -1;
+    SPI_END_ALLOW_THREADS(self)
+    self->swapping = 0;
+    if (ret < 0)
+    {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    self->batch = batch;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(SPI_set_result_ring_doc,
+        "set_result_ring(n)\n\n"
+        "Make transfer() return a read-only memoryview over one of n\n"
+        "result buffers owned by this handle, instead of a new tuple.\n"
+        "A view stays valid until n further transfers; after that its\n"
+        "buffer is reused. n 0 goes back to returning tuples.\n");
+
+static PyObject *SPI_set_result_ring(SPI *self, PyObject *args)
+{
+    PyObject *pool;
+    int n, i;
+
+    if (!PyArg_ParseTuple(args, "i:set_result_ring", &n))
+        return NULL;
+
+    if (n < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "ring size must not be negative");
+        return NULL;
+    }
+
+    SPI_ring_free(self);
+    if (n == 0)
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    pool = PyObject_CallFunction((PyObject *) &SPIBufferPool_type, "ni",
+            (Py_ssize_t) MAX_TRANSFER_LENGTH, n);
+    if (pool == NULL)
+        return NULL;
+
+    self->ring_buf = PyMem_New(PyObject *, n);
+    self->ring_view = PyMem_New(PyObject *, n);
+    if (self->ring_buf == NULL || self->ring_view == NULL)
+    {
+        PyMem_Free(self->ring_buf);
+        PyMem_Free(self->ring_view);
+        self->ring_buf = NULL;
+        self->ring_view = NULL;
+        Py_DECREF(pool);
+        return PyErr_NoMemory();
+    }
+    memset(self->ring_buf, 0, n * sizeof(PyObject *));
+    memset(self->ring_view, 0, n * sizeof(PyObject *));
+    self->ring_size = n;
+
+    for (i = 0; i < n; i++)
+    {
+        if ((self->ring_buf[i] = SPIBufferPool_get((SPIBufferPool *) pool)) == NULL)
+        {
+            SPI_ring_free(self);
+            Py_DECREF(pool);
+            return NULL;
+        }
+    }
+    Py_DECREF(pool); /* the buffers keep it alive */
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(SPI_set_combining_doc,
+        "set_combining(enable)\n\n"
+        "When many threads share this handle, let whichever thread gets\n"
+        "the bus send every waiting thread's transfer in one message,\n"
+        "releasing CS between them, and hand back each thread's data.\n");
+
+static PyObject *SPI_set_combining(SPI *self, PyObject *args)
+{
+    int enable;
+
+    if (!PyArg_ParseTuple(args, "i:set_combining", &enable))
+        return NULL;
+
+    if (enable && self->combiner == NULL)
+    {
+        if ((self->combiner = calloc(1, sizeof(*self->combiner))) == NULL)
+            return PyErr_NoMemory();
+        pthread_mutex_init(&self->combiner->lock, NULL);
+    }
+    self->combining = enable;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(SPI_stats_doc,
+        "stats() -> dict\n\n"
+        "Return this handle's counters: transfers, segments and bytes\n"
+        "sent, errors, how many transfers the rate limit delayed and for\n"
+        "how long in total, the time spent in the driver, the rate limits\n"
+        "in force, the clock speed, what autotune() found and the faults\n"
+        "set_faults() injected.\n");
+
+static PyObject *SPI_stats(SPI *self)
+{
+    struct spi_stats *st = &self->stats;
+    struct spi_faults none, *f = self->faults ? self->faults : &none;
+
+    memset(&none, 0, sizeof(none));
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:d,s:d,s:I,s:I,s:I,"
+            "s:K,s:K,s:K,s:K}",
+            "transfers", (unsigned long long) st->transfers,
+            "segments", (unsigned long long) st->segments,
+            "bytes", (unsigned long long) st->bytes,
+            "errors", (unsigned long long) st->errors,
+            "throttled", (unsigned long long) st->throttled,
+            "throttle_usec", (unsigned long long) (st->throttle_ns / 1000),
+            "io_usec", (unsigned long long) (st->io_ns / 1000),
+            "bytes_per_sec", self->byte_bucket.rate,
+            "transfers_per_sec", self->xfer_bucket.rate,
+            "speed_hz", self->speed,
+            "tuned_limit_hz", self->tune ? self->tune->limit_hz : 0,
+            "retunes", self->tune ? self->tune->retunes : 0,
+            "injected_errors", (unsigned long long) f->errors,
+            "injected_flips", (unsigned long long) f->flips,
+            "injected_delays", (unsigned long long) f->delays,
+            "injected_busy", (unsigned long long) f->busy);
+}
+
+PyDoc_STRVAR(SPI_serve_doc,
+        "serve(bus, device, mock=False)\n\n"
+        "Become the broker for /dev/spidevX.Y: open the device and run\n"
+        "messages submitted by SPI(X, Y, broker=True) objects in any\n"
+        "process, until interrupted. With mock, messages go to the mock\n"
+        "backend instead, so clients can be tried without hardware.\n");
+
+static PyObject *SPI_serve(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    int bus, device, fd, mock = 0;
+    char path[MAXPATH];
+    struct spi_broker *broker;
+    SPI dev;
+    unsigned int i, pass, cursor = 0;
+    uint32_t doorbell;
+    uint64_t cfg, last_cfg = 0, reaped = 0;
+    pid_t old_pid;
+    int served;
+    static char *kwlist[] = { "bus", "device", "mock", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii|i:serve", kwlist, &bus,
+            &device, &mock))
+        return NULL;
+
+    if (spi_broker_path(path, MAXPATH, bus, device))
+    {
+        PyErr_SetString(PyExc_OverflowError,
+                "Bus and/or device number is invalid.");
+        return NULL;
+    }
+
+    memset(&dev, 0, sizeof(dev));
+    dev.fd = -1;
+    if (mock)
+        SPI_connect_mock(&dev);
+    else if (SPI_connect_device(&dev, bus, device) < 0)
+    {
+        if (dev.fd >= 0)
+            close(dev.fd);
+        return NULL;
+    }
+    fd = dev.fd;
+
+    if ((broker = spi_broker_map(path, O_RDWR | O_CREAT)) == NULL)
+    {
+        if (fd >= 0)
+            close(fd);
+        PyErr_Format(SpiError, "can't create broker: %s", path);
+        return NULL;
+    }
+
+    /* claim the table: nobody else may be serving it, even in this process */
+    old_pid = broker->pid;
+    if (spi_pid_alive(old_pid)
+            || !__sync_bool_compare_and_swap(&broker->pid, old_pid, getpid()))
+    {
+        munmap(broker, sizeof(*broker));
+        if (fd >= 0)
+            close(fd);
+        PyErr_Format(SpiError, "broker already running: %s", path);
+        return NULL;
+    }
+
+    /*
+     * Taking over from a broker that died keeps the slots, clients may be
+     * waiting on them; only a table of another layout is wiped.
+     */
+    if (broker->magic != BROKER_MAGIC || broker->version != BROKER_VERSION)
+    {
+        broker->magic = 0;
+        __sync_synchronize();
+        memset(broker->slot, 0, sizeof(broker->slot));
+        broker->doorbell = 0;
+        broker->freed = 0;
+        broker->next = 0;
+    }
+    broker->mode = dev.mode;
+    broker->bpw = dev.bpw;
+    broker->msh = dev.msh;
+    broker->version = BROKER_VERSION;
+    __sync_synchronize();
+    broker->magic = BROKER_MAGIC;
+
+    for (;;)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        do
+        {
+            doorbell = broker->doorbell;
+            served = 0;
+            if (spi_now() - reaped > BROKER_POLL_MS * 1000000ULL)
+            {
+                spi_broker_reap(broker);
+                reaped = spi_now();
+            }
+            /*
+             * Clients wait for each message, so any order is fine: first
+             * serve the ones that don't need the controller reprogrammed,
+             * then the rest.
+             */
+            for (pass = 0; pass < 2; pass++)
+                for (i = 0; i < BROKER_SLOTS; i++)
+                {
+                    struct spi_broker_slot *slot =
+                            &broker->slot[(cursor + i) % BROKER_SLOTS];
+                    if (slot->state != SLOT_SUBMITTED)
+                        continue;
+                    __sync_synchronize();
+                    cfg = spi_cfg_key(0, slot->seg[0].speed_hz,
+                            slot->seg[0].bits_per_word, slot->seg[0].tx_nbits,
+                            slot->seg[0].rx_nbits);
+                    if (pass == 0 && cfg != last_cfg)
+                        continue;
+                    last_cfg = cfg;
+                    spi_broker_run(&dev, slot);
+                    served++;
+                }
+            cursor++;
+        } while (served || spi_futex_wait(&broker->doorbell, doorbell,
+                BROKER_POLL_MS) == 0 || errno == EAGAIN);
+        Py_END_ALLOW_THREADS
+
+        if (PyErr_CheckSignals() < 0)
+            break;
+    }
+
+    broker->magic = 0;
+    broker->pid = 0;
+    munmap(broker, sizeof(*broker));
+    shm_unlink(path);
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+PyDoc_STRVAR(SPI_trace_start_doc,
+        "trace_start(records=65536)\n\n"
+        "Start recording every message sent by every handle in this\n"
+        "process into an in-memory ring of the given size, rounded up to\n"
+        "a power of two, keeping the newest. The ring is allocated on the\n"
+        "first call and reused after that. See trace_export().\n");
+
+static PyObject *SPI_trace_start(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    unsigned long records = TRACE_RECORDS, size = 1;
+    static char *kwlist[] = { "records", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|k:trace_start", kwlist,
+            &records))
+        return NULL;
+    while (size < records)
+        size <<= 1;
+
+    if (spi_trace.rec == NULL)
+    {
+        /* never freed, a sender may still be writing to it */
+        if ((spi_trace.rec = calloc(size, sizeof(*spi_trace.rec))) == NULL)
+            return PyErr_NoMemory();
+        spi_trace.mask = size - 1;
+    }
+    else if (size != spi_trace.mask + 1)
+        return PyErr_Format(PyExc_ValueError,
+                "trace ring already holds %lu records",
+                (unsigned long) spi_trace.mask + 1);
+
+    spi_trace.enabled = 0;
+    __sync_synchronize();
+    memset(spi_trace.rec, 0, size * sizeof(*spi_trace.rec));
+    spi_trace.head = 0;
+    spi_trace.epoch = spi_now();
+    __sync_synchronize();
+    spi_trace.enabled = 1;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(SPI_trace_stop_doc,
+        "trace_stop()\n\n"
+        "Stop recording messages. What was recorded stays available to\n"
+        "trace_export() until the next trace_start().\n");
+
+static PyObject *SPI_trace_stop(PyObject *module)
+{
+    spi_trace.enabled = 0;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+struct spi_strbuf
+{
+    char *data;
+    size_t len;
+    size_t alloc;
+};
+
+static int spi_strbuf_printf(struct spi_strbuf *sb, const char *fmt, ...)
+{
+    va_list ap;
+    char *data;
+    int len;
+
+    for (;;)
+    {
+        va_start(ap, fmt);
+        len = vsnprintf(sb->data + sb->len, sb->alloc - sb->len, fmt, ap);
+        va_end(ap);
+        if (len < 0)
+            return -1;
+        if (sb->len + len < sb->alloc)
+            break;
+        if ((data = realloc(sb->data, 2 * sb->alloc + len)) == NULL)
+            return -1;
+        sb->data = data;
+        sb->alloc = 2 * sb->alloc + len;
+    }
+    sb->len += len;
+    return 0;
+}
+
+PyDoc_STRVAR(SPI_trace_export_doc,
+        "trace_export(path=None) -> str or None\n\n"
+        "Render the recorded messages as Chrome trace-event JSON, which\n"
+        "chrome://tracing and ui.perfetto.dev open. Each bus is a process\n"
+        "and each chip select a thread in it, with one slice per message\n"
+        "giving its size, segments, result and the sending thread. The\n"
+        "JSON is written to path if given, otherwise returned.\n");
+
+static PyObject *SPI_trace_export(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    const char *path = NULL;
+    struct spi_strbuf sb;
+    struct spi_trace_rec rec;
+    uint32_t track[TRACE_TRACKS];
+    unsigned int ntracks = 0, t;
+    uint64_t head, i, seq;
+    PyObject *result = NULL;
+    int ok = 0, err;
+    FILE *f;
+    static char *kwlist[] = { "path", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|z:trace_export", kwlist,
+            &path))
+        return NULL;
+
+    sb.alloc = 4096;
+    sb.len = 0;
+    if ((sb.data = malloc(sb.alloc)) == NULL)
+        return PyErr_NoMemory();
+
+    Py_BEGIN_ALLOW_THREADS
+    head = spi_trace.rec != NULL ? spi_trace.head : 0;
+    i = head > spi_trace.mask + 1 ? head - spi_trace.mask - 1 : 0;
+    ok = spi_strbuf_printf(&sb, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[") == 0;
+    for (; ok && i < head; i++)
+    {
+        struct spi_trace_rec *live = &spi_trace.rec[i & spi_trace.mask];
+
+        seq = live->seq;
+        __sync_synchronize();
+        rec = *live;
+        __sync_synchronize();
+        if (seq != i + 1 || live->seq != seq)
+            continue;
+
+        /* name the bus and chip select tracks the first time they appear */
+        for (t = 0; t < ntracks; t++)
+            if (track[t] == ((uint32_t) (uint16_t) rec.bus << 16 | (uint16_t) rec.device))
+                break;
+        if (t == ntracks && ntracks < TRACE_TRACKS)
+        {
+            track[ntracks++] = (uint32_t) (uint16_t) rec.bus << 16 | (uint16_t) rec.device;
+            ok = spi_strbuf_printf(&sb,
+                    "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+                    "\"args\":{\"name\":\"spi%d\"}},"
+                    "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,"
+                    "\"tid\":%d,\"args\":{\"name\":\"spidev%d.%d\"}},",
+                    rec.bus, rec.bus, rec.bus, rec.device, rec.bus,
+                    rec.device) == 0;
+        }
+
+        if (ok)
+            ok = spi_strbuf_printf(&sb,
+                    "{\"ph\":\"X\",\"name\":\"%u bytes\",\"pid\":%d,"
+                    "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{"
+                    "\"bytes\":%u,\"segments\":%u,\"result\":%d,"
+                    "\"thread\":%d}},",
+                    rec.bytes, rec.bus, rec.device,
+                    (rec.start - spi_trace.epoch) / 1e3,
+                    (rec.end - rec.start) / 1e3, rec.bytes, rec.segments,
+                    rec.result, rec.tid) == 0;
+    }
+    if (ok)
+    {
+        if (sb.data[sb.len - 1] == ',')
+            sb.len--;
+        ok = spi_strbuf_printf(&sb, "]}\n") == 0;
+    }
+
+    err = 0;
+    if (ok && path != NULL)
+    {
+        if ((f = fopen(path, "w")) == NULL
+                || fwrite(sb.data, 1, sb.len, f) != sb.len)
+            err = errno;
+        if (f != NULL && fclose(f) != 0 && err == 0)
+            err = errno;
+    }
+    Py_END_ALLOW_THREADS
+
+    if (!ok)
+        PyErr_NoMemory();
+    else if (err != 0)
+    {
+        errno = err;
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) path);
+    }
+    else if (path != NULL)
+    {
+        Py_INCREF(Py_None);
+        result = Py_None;
+    }
+    else
+        result = PyString_FromStringAndSize(sb.data, sb.len);
+    free(sb.data);
+    return result;
+}
+
+PyDoc_STRVAR(SPI_utilization_doc,
+        "utilization(bus) -> dict\n\n"
+        "How busy bus X has been over the last 1, 10 and 60 seconds,\n"
+        "counting messages from every handle in this process except\n"
+        "mock ones. For each window: messages and bytes, the busy\n"
+        "fraction (time in the driver over the window), the idle gaps\n"
+        "between messages, and the efficiency: how much of the busy\n"
+        "time the bits needed on the wire at the clock used, capped at 1\n"
+        "since a controller may run slower than asked. Low efficiency\n"
+        "says batching would help, high busy and efficiency that only a\n"
+        "faster clock will. reconfigs counts segments that needed a\n"
+        "different mode, speed, word size or bus width from the one\n"
+        "before.\n");
+
+static PyObject *SPI_utilization(PyObject *module, PyObject *args)
+{
+    static const int windows[] = { 1, 10, 60 };
+    struct spi_util_sec total, *sec;
+    struct spi_util *util;
+    uint64_t now = spi_now(), now_sec = now / 1000000000ULL, from, span;
+    PyObject *result, *item, *key;
+    unsigned int w, i;
+    int bus;
+
+    if (!PyArg_ParseTuple(args, "i:utilization", &bus))
+        return NULL;
+    if (bus < 0 || bus >= UTIL_BUSES)
+        return PyErr_Format(PyExc_ValueError, "bus must be 0 to %d",
+                UTIL_BUSES - 1);
+    util = &spi_util[bus];
+
+    if ((result = PyDict_New()) == NULL)
+        return NULL;
+
+    for (w = 0; w < ARRAY_SIZE(windows); w++)
+    {
+        memset(&total, 0, sizeof(total));
+        pthread_mutex_lock(&util->lock);
+        for (i = 0; i < UTIL_SECONDS; i++)
+        {
+            sec = &util->sec[i];
+            if (sec->sec + windows[w] <= now_sec || sec->sec > now_sec)
+                continue;
+            total.messages += sec->messages;
+            total.bytes += sec->bytes;
+            total.busy_ns += sec->busy_ns;
+            total.wire_ns += sec->wire_ns;
+            total.gaps += sec->gaps;
+            total.gap_ns += sec->gap_ns;
+            total.reconfigs += sec->reconfigs;
+            if (sec->max_gap_ns > total.max_gap_ns)
+                total.max_gap_ns = sec->max_gap_ns;
+        }
+        from = (now_sec + 1 - windows[w]) * 1000000000ULL;
+        if (util->first > from)
+            from = util->first;
+        pthread_mutex_unlock(&util->lock);
+        span = now > from ? now - from : 0;
+
+        item = Py_BuildValue("{s:K,s:K,s:d,s:K,s:d,s:d,s:d,s:K}",
+                "messages", (unsigned long long) total.messages,
+                "bytes", (unsigned long long) total.bytes,
+                "busy", span ? (double) total.busy_ns / span : 0.0,
+                "idle_gaps", (unsigned long long) total.gaps,
+                "mean_gap_usec", total.gaps ? total.gap_ns / 1e3 / total.gaps : 0.0,
+                "max_gap_usec", total.max_gap_ns / 1e3,
+                "efficiency", total.busy_ns == 0 ? 0.0
+                        : total.wire_ns >= total.busy_ns ? 1.0
+                        : (double) total.wire_ns / total.busy_ns,
+                "reconfigs", (unsigned long long) total.reconfigs);
+        key = PyInt_FromLong(windows[w]);
+        if (item == NULL || key == NULL || PyDict_SetItem(result, key, item) < 0)
+        {
+            Py_XDECREF(item);
+            Py_XDECREF(key);
+            Py_DECREF(result);
+            return NULL;
+        }
+        Py_DECREF(item);
+        Py_DECREF(key);
+    }
+    return result;
+}
+
+PyDoc_STRVAR(SPI_read_stats_doc,
+        "read_stats(name) -> dict\n\n"
+        "Read the counters another handle, possibly in another process,\n"
+        "publishes with publish_stats(). latency is the histogram of\n"
+        "time in the driver: entry i counts messages under 2**i usec.\n");
+
+static PyObject *SPI_read_stats(PyObject *module, PyObject *args)
+{
+    struct spi_pubstats *live, copy;
+    PyObject *latency;
+    const char *name;
+    uint32_t seq;
+    unsigned int i, tries;
+    int fd;
+
+    if (!PyArg_ParseTuple(args, "s:read_stats", &name))
+        return NULL;
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) name);
+    live = mmap(NULL, sizeof(*live), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (live == MAP_FAILED)
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) name);
+
+    /* a writer that died mid-update leaves seq odd for good */
+    for (tries = 0; tries < PUB_READ_TRIES; tries++)
+    {
+        if ((seq = live->seq) & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        __sync_synchronize();
+        copy = *live;
+        __sync_synchronize();
+        if (live->seq == seq)
+            break;
+    }
+    munmap(live, sizeof(*live));
+    if (tries == PUB_READ_TRIES)
+        return PyErr_Format(SpiError, "%s: no consistent copy", name);
+
+    if (copy.magic != PUB_MAGIC || copy.version != PUB_VERSION
+            || copy.size != sizeof(copy))
+        return PyErr_Format(SpiError, "%s: not spipy stats version %d", name,
+                PUB_VERSION);
+
+    if ((latency = PyList_New(PUB_LAT_BUCKETS)) == NULL)
+        return NULL;
+    for (i = 0; i < PUB_LAT_BUCKETS; i++)
+        PyList_SET_ITEM(latency, i,
+                PyLong_FromUnsignedLongLong(copy.latency[i]));
+
+    return Py_BuildValue("{s:i,s:i,s:i,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:N}",
+            "pid", copy.pid, "bus", copy.bus, "device", copy.device,
+            "transfers", (unsigned long long) copy.transfers,
+            "segments", (unsigned long long) copy.segments,
+            "bytes", (unsigned long long) copy.bytes,
+            "errors", (unsigned long long) copy.errors,
+            "throttled", (unsigned long long) copy.throttled,
+            "throttle_usec", (unsigned long long) (copy.throttle_ns / 1000),
+            "io_usec", (unsigned long long) (copy.io_ns / 1000),
+            "latency", latency);
+}
+
+PyDoc_STRVAR(SPI_read_sample_doc,
+        "read_sample(name) -> dict\n\n"
+        "Return the newest sample a start_sampler() thread, in this or\n"
+        "another process, published under name: the bytes read, the\n"
+        "sample number, when it was taken as CLOCK_REALTIME and\n"
+        "CLOCK_MONOTONIC seconds, and the errno if that transfer failed.\n"
+        "Doesn't take any lock or touch the bus.\n");
+
+static PyObject *SPI_read_sample(PyObject *module, PyObject *args)
+{
+    struct spi_sample *live, copy;
+    const char *name;
+    unsigned int tries;
+    uint32_t seq;
+    int fd;
+
+    if (!PyArg_ParseTuple(args, "s:read_sample", &name))
+        return NULL;
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) name);
+    live = mmap(NULL, sizeof(*live), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (live == MAP_FAILED)
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) name);
+
+    for (tries = 0; tries < PUB_READ_TRIES; tries++)
+    {
+        if ((seq = live->seq) & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        __sync_synchronize();
+        copy = *live;
+        __sync_synchronize();
+        if (live->seq == seq)
+            break;
+    }
+    munmap(live, sizeof(*live));
+    if (tries == PUB_READ_TRIES)
+        return PyErr_Format(SpiError, "%s: no consistent copy", name);
+
+    if (copy.magic != SAMPLE_MAGIC || copy.version != SAMPLE_VERSION
+            || copy.size != sizeof(copy) || copy.len > MAX_TRANSFER_LENGTH)
+        return PyErr_Format(SpiError, "%s: not a spipy sample version %d",
+                name, SAMPLE_VERSION);
+
+    return Py_BuildValue("{s:N,s:K,s:d,s:d,s:i}",
+            "data", spi_buf_to_tuple(copy.data, copy.count ? copy.len : 0),
+            "count", (unsigned long long) copy.count,
+            "time", copy.real_ns / 1e9,
+            "monotonic", copy.mono_ns / 1e9,
+            "error", copy.error);
+}
+
+static PyMethodDef SPI_module_methods[] =
+{
+        { "serve", (PyCFunction) SPI_serve, METH_VARARGS | METH_KEYWORDS, SPI_serve_doc },
+        { "trace_start", (PyCFunction) SPI_trace_start, METH_VARARGS | METH_KEYWORDS, SPI_trace_start_doc },
+        { "trace_stop", (PyCFunction) SPI_trace_stop, METH_NOARGS, SPI_trace_stop_doc },
+        { "utilization", (PyCFunction) SPI_utilization, METH_VARARGS, SPI_utilization_doc },
+        { "read_stats", (PyCFunction) SPI_read_stats, METH_VARARGS, SPI_read_stats_doc },
+        { "read_sample", (PyCFunction) SPI_read_sample, METH_VARARGS, SPI_read_sample_doc },
+        { "trace_export", (PyCFunction) SPI_trace_export, METH_VARARGS | METH_KEYWORDS, SPI_trace_export_doc },
+        { NULL },
+};
+
+PyDoc_STRVAR(SPI_type_doc,
+        "SPI([bus],[client],[broker]) -> SPI\n\n"
+        "Return a new SPI object that is (optionally) connected to the\n"
+        "specified SPI device interface.\n");
+
+static PyMethodDef SPI_methods[] =
+{
+    { "open", (PyCFunction) SPI_open, METH_VARARGS | METH_KEYWORDS, SPI_open_doc },
+    { "close", (PyCFunction) SPI_close, METH_NOARGS, SPI_close_doc },
+    { "transfer", (PyCFunction) SPI_transfer, METH_VARARGS | METH_KEYWORDS, SPI_transfer_doc },
+    { "transfer_verify", (PyCFunction) SPI_transfer_verify, METH_VARARGS | METH_KEYWORDS, SPI_transfer_verify_doc },
+    { "transfer_batch", (PyCFunction) SPI_transfer_batch, METH_VARARGS | METH_KEYWORDS, SPI_transfer_batch_doc },
+    { "write", (PyCFunction) SPI_write, METH_VARARGS, SPI_write_doc },
+    { "flash_read", (PyCFunction) SPI_flash_read, METH_VARARGS | METH_KEYWORDS, SPI_flash_read_doc },
+    { "read_to_fd", (PyCFunction) SPI_read_to_fd, METH_VARARGS | METH_KEYWORDS, SPI_read_to_fd_doc },
+    { "write_from_fd", (PyCFunction) SPI_write_from_fd, METH_VARARGS | METH_KEYWORDS, SPI_write_from_fd_doc },
+    { "write_from_mmap", (PyCFunction) SPI_write_from_mmap, METH_VARARGS | METH_KEYWORDS, SPI_write_from_mmap_doc },
+    { "flush", (PyCFunction) SPI_flush_method, METH_NOARGS, SPI_flush_doc },
+    { "lock", (PyCFunction) SPI_lock, METH_VARARGS, SPI_lock_doc },
+    { "unlock", (PyCFunction) SPI_unlock, METH_NOARGS, SPI_unlock_doc },
+    { "schedule", (PyCFunction) SPI_schedule, METH_VARARGS | METH_KEYWORDS, SPI_schedule_doc },
+    { "cancel", (PyCFunction) SPI_cancel, METH_VARARGS, SPI_cancel_doc },
+    { "run", (PyCFunction) SPI_run, METH_VARARGS, SPI_run_doc },
+    { "result", (PyCFunction) SPI_result, METH_VARARGS, SPI_result_doc },
+    { "schedule_stats", (PyCFunction) SPI_schedule_stats, METH_NOARGS, SPI_schedule_stats_doc },
+    { "set_mode", (PyCFunction) SPI_set_mode, METH_VARARGS, SPI_set_mode_doc },
+    { "get_mode", (PyCFunction) SPI_get_mode, METH_NOARGS, SPI_get_mode_doc },
+    { "set_speed", (PyCFunction) SPI_set_speed, METH_VARARGS, SPI_set_speed_doc },
+    { "autotune", (PyCFunction) SPI_autotune, METH_VARARGS | METH_KEYWORDS, SPI_autotune_doc },
+    { "calibrate", (PyCFunction) SPI_calibrate, METH_VARARGS | METH_KEYWORDS, SPI_calibrate_doc },
+    { "set_trace_markers", (PyCFunction) SPI_set_trace_markers, METH_VARARGS | METH_KEYWORDS, SPI_set_trace_markers_doc },
+    { "publish_stats", (PyCFunction) SPI_publish_stats, METH_VARARGS | METH_KEYWORDS, SPI_publish_stats_doc },
+    { "start_sampler", (PyCFunction) SPI_start_sampler, METH_VARARGS | METH_KEYWORDS, SPI_start_sampler_doc },
+    { "stop_sampler", (PyCFunction) SPI_stop_sampler_method, METH_NOARGS, SPI_stop_sampler_doc },
+    { "set_faults", (PyCFunction) SPI_set_faults, METH_VARARGS | METH_KEYWORDS, SPI_set_faults_doc },
+    { "set_rate_limit", (PyCFunction) SPI_set_rate_limit, METH_VARARGS | METH_KEYWORDS, SPI_set_rate_limit_doc },
+    { "set_autobatch", (PyCFunction) SPI_set_autobatch, METH_VARARGS, SPI_set_autobatch_doc },
+    { "set_result_ring", (PyCFunction) SPI_set_result_ring, METH_VARARGS, SPI_set_result_ring_doc },
+    { "set_combining", (PyCFunction) SPI_set_combining, METH_VARARGS, SPI_set_combining_doc },
+    { "stats", (PyCFunction) SPI_stats, METH_NOARGS, SPI_stats_doc },
+    { "kernel_stats", (PyCFunction) SPI_kernel_stats, METH_NOARGS, SPI_kernel_stats_doc },
+    { NULL },
+};
+
+static PyTypeObject SPI_type =
+{
+    PyObject_HEAD_INIT(NULL)
+    0,                 /* ob_size */
+    "SPI",             /* tp_name */
+    sizeof(SPI),     /* tp_basicsize */
+    0, /* tp_itemsize */
+    (destructor)SPI_dealloc, /* tp_dealloc */
+    0, /* tp_print */
+    0, /* tp_getattr */
+    0, /* tp_setattr */
+    0, /* tp_compare */
+    0, /* tp_repr */
+    0, /* tp_as_number */
+    0, /* tp_as_sequence */
+    0, /* tp_as_mapping */
+    0, /* tp_hash */
+    0, /* tp_call */
+    0, /* tp_str */
+    0, /* tp_getattro */
+    0, /* tp_setattro */
+    0, /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT, /* tp_flags */
+    SPI_type_doc, /* tp_doc */
+    0, /* tp_traverse */
+    0, /* tp_clear */
+    0, /* tp_richcompare */
+    0, /* tp_weaklistoffset */
+    0, /* tp_iter */
+    0, /* tp_iternext */
+    SPI_methods, /* tp_methods */
+    0, /* tp_members */
+    0, /* tp_getset */
+    0, /* tp_base */
+    0, /* tp_dict */
+    0, /* tp_descr_get */
+    0, /* tp_descr_set */
+    0, /* tp_dictoffset */
+    (initproc)SPI_init, /* tp_init */
+    0, /* tp_alloc */
+    SPI_new, /* tp_new */
+};
+
+#ifndef PyMODINIT_FUNC    /* declarations for DLL import/export */
+#define PyMODINIT_FUNC void
+#endif
+
+PyMODINIT_FUNC
+initspipy(void)
+{
+    PyObject* m;
+    int i;
+
+    for (i = 0; i < UTIL_BUSES; i++)
+        pthread_mutex_init(&spi_util[i].lock, NULL);
+
+    if (PyType_Ready(&SPI_type) < 0)
+        return;
+    if (PyType_Ready(&SPIBuffer_type) < 0)
+        return;
+    if (PyType_Ready(&SPIBufferPool_type) < 0)
+        return;
+
+    m = Py_InitModule3("spipy", SPI_module_methods, SPI_module_doc);
+    Py_INCREF(&SPI_type);
+    PyModule_AddObject(m, "SPI", (PyObject *) &SPI_type);
+    Py_INCREF(&SPIBufferPool_type);
+    PyModule_AddObject(m, "SPIBufferPool", (PyObject *) &SPIBufferPool_type);
+
+    // make a new exception
+    SpiError = PyErr_NewException("spi.error", NULL, NULL);
+    Py_INCREF(SpiError);
+    PyModule_AddObject(m, "error", SpiError);
+
+    PyModule_AddIntConstant(m, "PRIO_BULK", PRIO_BULK);
+    PyModule_AddIntConstant(m, "PRIO_NORMAL", PRIO_NORMAL);
+    PyModule_AddIntConstant(m, "PRIO_CRITICAL", PRIO_CRITICAL);
+    PyModule_AddIntConstant(m, "SPI_TX_DUAL", SPI_TX_DUAL);
+    PyModule_AddIntConstant(m, "SPI_TX_QUAD", SPI_TX_QUAD);
+    PyModule_AddIntConstant(m, "SPI_RX_DUAL", SPI_RX_DUAL);
+    PyModule_AddIntConstant(m, "SPI_RX_QUAD", SPI_RX_QUAD);
+}
@@ -0,0 +1,130 @@
+#!/usr/bin/env python
+"""Autobatching on the mock backend, so no hardware is needed:
+
+    $ python tests/test_autobatch.py
+"""
+import signal
+import threading
+import time
+import unittest
+
+import spipy
+
+
+class AutobatchLockTest(unittest.TestCase):
+
+    def setUp(self):
+        # a deadlock fails the test instead of hanging the run
+        signal.alarm(5)
+
+    def tearDown(self):
+        signal.alarm(0)
+
+    def test_read_under_lock_flushes(self):
+        spi = spipy.SPI(0, 0, mock=True, lock=True)
+        spi.set_autobatch(8, 1000)
+        spi.lock()
+        try:
+            spi.write((1, 2))
+            # let the window expire so the flusher sees the queue
+            time.sleep(0.05)
+            self.assertEqual(spi.transfer((3,)), (3,))
+        finally:
+            spi.unlock()
+            spi.close()
+
+    def test_lock_while_holder_flushes(self):
+        spi = spipy.SPI(0, 0, mock=True, lock=True)
+        spi.set_autobatch(8, 1000)
+
+        def holder():
+            spi.lock()
+            time.sleep(0.05)
+            spi.write((1, 2))
+            spi.flush()
+            spi.unlock()
+
+        def waiter():
+            time.sleep(0.01)
+            spi.lock()
+            spi.transfer((3,))
+            spi.unlock()
+
+        threads = [threading.Thread(target=f) for f in (holder, waiter)]
+        for t in threads:
+            t.daemon = True
+            t.start()
+        for t in threads:
+            t.join(5)
+            self.assertFalse(t.is_alive())
+        spi.close()
+
+    def test_queue_goes_out_after_unlock(self):
+        spi = spipy.SPI(0, 0, mock=True, lock=True)
+        spi.set_autobatch(8, 1000)
+        spi.lock()
+        spi.write((1, 2))
+        time.sleep(0.05)
+        spi.unlock()
+        # sent by unlock() itself, before the bus was released
+        self.assertEqual(spi.stats()["transfers"], 1)
+        spi.close()
+
+
+class AutobatchSwapTest(unittest.TestCase):
+
+    def setUp(self):
+        signal.alarm(10)
+
+    def tearDown(self):
+        signal.alarm(0)
+
+    def test_set_autobatch_while_writing(self):
+        spi = spipy.SPI(0, 0, mock=True)
+        spi.set_faults(seed=1, latency_usec=2000, latency_rate=0.5)
+        spi.set_autobatch(2, 1000)
+        stop = []
+
+        def writer():
+            while not stop:
+                spi.write((1, 2, 3))
+
+        threads = [threading.Thread(target=writer) for i in range(3)]
+        for t in threads:
+            t.daemon = True
+            t.start()
+        for i in range(20):
+            spi.set_autobatch(2 + i % 3, 1000)
+        stop.append(True)
+        for t in threads:
+            t.join(5)
+            self.assertFalse(t.is_alive())
+        spi.close()
+
+    def test_close_while_writing(self):
+        spi = spipy.SPI(0, 0, mock=True)
+        spi.set_faults(seed=1, latency_usec=2000, latency_rate=0.5)
+        spi.set_autobatch(2, 1000)
+        errors = []
+
+        def writer():
+            try:
+                while True:
+                    spi.write((1, 2, 3))
+            except IOError as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=writer) for i in range(3)]
+        for t in threads:
+            t.daemon = True
+            t.start()
+        time.sleep(0.02)
+        spi.close()
+        for t in threads:
+            t.join(5)
+            self.assertFalse(t.is_alive())
+        self.assertEqual(len(errors), 3)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,51 @@
+#!/usr/bin/env python
+"""autotune() on the mock backend, which loops the probe back:
+
+    $ python tests/test_autotune.py
+"""
+import signal
+import threading
+import unittest
+
+import spipy
+
+
+class AutotuneTest(unittest.TestCase):
+
+    def setUp(self):
+        signal.alarm(10)
+
+    def tearDown(self):
+        signal.alarm(0)
+
+    def test_loopback_tunes_to_margin(self):
+        spi = spipy.SPI(0, 0, mock=True)
+        hz = spi.autotune((0x55, 0xaa), max_hz=1000000, margin=0.5)
+        self.assertEqual(hz, 500000)
+        spi.close()
+
+    def test_retune_while_transferring(self):
+        spi = spipy.SPI(0, 0, mock=True)
+        spi.set_faults(seed=1, latency_usec=1000, latency_rate=0.5)
+        spi.autotune((0x55, 0xaa), max_hz=1000000, reverify=0.0001)
+        stop = []
+
+        def transferrer():
+            while not stop:
+                spi.transfer((1, 2, 3))
+
+        threads = [threading.Thread(target=transferrer) for i in range(3)]
+        for t in threads:
+            t.daemon = True
+            t.start()
+        for i in range(10):
+            spi.autotune((0x55, 0xaa), max_hz=1000000, reverify=0.0001)
+        stop.append(True)
+        for t in threads:
+            t.join(5)
+            self.assertFalse(t.is_alive())
+        spi.close()
+
+
+if __name__ == "__main__":
+    unittest.main()
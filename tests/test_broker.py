@@ -0,0 +1,141 @@
+#!/usr/bin/env python
+"""The shared memory broker, served by spipy.serve(mock=True) in a child
+process so no hardware is needed:
+
+    $ python tests/test_broker.py
+"""
+import ctypes
+import errno
+import mmap
+import os
+import signal
+import subprocess
+import sys
+import time
+import unittest
+
+import spipy
+
+BUS, DEVICE = 9, 0
+SLOT_FREE, SLOT_CLAIMED, SLOT_SUBMITTED, SLOT_DONE = range(4)
+BROKER_SLOTS, BROKER_MAX_SEGS, BROKER_PAYLOAD = 16, 8, 4096
+
+
+# mirrors struct spi_broker in spipy.c
+class Seg(ctypes.Structure):
+    _fields_ = [("len", ctypes.c_uint32), ("speed_hz", ctypes.c_uint32),
+                ("delay_usecs", ctypes.c_uint16),
+                ("bits_per_word", ctypes.c_uint8),
+                ("cs_change", ctypes.c_uint8), ("tx_nbits", ctypes.c_uint8),
+                ("rx_nbits", ctypes.c_uint8)]
+
+
+class Slot(ctypes.Structure):
+    _fields_ = [("state", ctypes.c_uint32), ("owner", ctypes.c_int32),
+                ("result", ctypes.c_int32), ("error", ctypes.c_int32),
+                ("nsegs", ctypes.c_uint32), ("seg", Seg * BROKER_MAX_SEGS),
+                ("data", ctypes.c_uint8 * BROKER_PAYLOAD)]
+
+
+class Broker(ctypes.Structure):
+    _fields_ = [("magic", ctypes.c_uint32), ("version", ctypes.c_uint32),
+                ("pid", ctypes.c_int32), ("mode", ctypes.c_uint32),
+                ("bpw", ctypes.c_uint8), ("msh", ctypes.c_uint32),
+                ("doorbell", ctypes.c_uint32), ("freed", ctypes.c_uint32),
+                ("next", ctypes.c_uint32), ("slot", Slot * BROKER_SLOTS)]
+
+
+def wait_for(cond, timeout=5):
+    end = time.time() + timeout
+    while not cond():
+        if time.time() > end:
+            return False
+        time.sleep(0.01)
+    return True
+
+
+class BrokerTest(unittest.TestCase):
+
+    def setUp(self):
+        signal.alarm(20)
+        self.server = subprocess.Popen([sys.executable, "-c",
+                "import spipy\n"
+                "try:\n"
+                "    spipy.serve(%d, %d, mock=True)\n"
+                "except KeyboardInterrupt:\n"
+                "    pass\n" % (BUS, DEVICE)])
+        self.spi = None
+
+        def connect():
+            try:
+                self.spi = spipy.SPI(BUS, DEVICE, broker=True)
+            except spipy.error:
+                return False
+            return True
+        self.assertTrue(wait_for(connect))
+
+        with open("/dev/shm/spipy-%d.%d" % (BUS, DEVICE), "r+b") as f:
+            self.map = mmap.mmap(f.fileno(), ctypes.sizeof(Broker))
+        self.table = Broker.from_buffer(self.map)
+
+    def tearDown(self):
+        del self.table
+        self.map.close()
+        self.spi.close()
+        self.server.send_signal(signal.SIGINT)
+        self.server.wait()
+        signal.alarm(0)
+
+    def claim(self, owner):
+        for slot in self.table.slot:
+            if slot.state == SLOT_FREE:
+                slot.state = SLOT_CLAIMED
+                slot.owner = owner
+                return slot
+        self.fail("no free slot")
+
+    def submit(self, slot):
+        slot.state = SLOT_SUBMITTED
+        self.table.doorbell += 1
+        # the broker looks at the table at least every BROKER_POLL_MS
+        self.assertTrue(wait_for(lambda: slot.state == SLOT_DONE))
+        result, error = slot.result, slot.error
+        slot.owner = 0
+        slot.state = SLOT_FREE
+        return result, error
+
+    def test_transfer(self):
+        self.assertEqual(self.spi.transfer((1, 2, 3)), (1, 2, 3))
+
+    def test_message_over_payload(self):
+        self.assertRaises(IOError, self.spi.write,
+                bytearray(BROKER_PAYLOAD + 1))
+
+    def test_verify_in_slot_sized_chunks(self):
+        data = bytearray(os.urandom(3 * BROKER_PAYLOAD))
+        self.assertEqual(self.spi.transfer_verify(data, data), (0, ()))
+
+    def test_segments_overrunning_payload(self):
+        slot = self.claim(os.getpid())
+        slot.nsegs = BROKER_MAX_SEGS
+        for seg in slot.seg:
+            seg.len = BROKER_PAYLOAD // 4
+        self.assertEqual(self.submit(slot), (-1, errno.EMSGSIZE))
+
+    def test_too_many_segments(self):
+        slot = self.claim(os.getpid())
+        slot.nsegs = 1000
+        for seg in slot.seg:
+            seg.len = 1
+        self.assertEqual(self.submit(slot), (-1, errno.EMSGSIZE))
+
+    def test_dead_client_slot_is_reaped(self):
+        child = subprocess.Popen(["true"])
+        child.wait()
+        slot = self.claim(child.pid)
+        self.assertTrue(wait_for(lambda: slot.state == SLOT_FREE))
+        self.assertEqual(slot.owner, 0)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,84 @@
+#!/usr/bin/env python
+"""The cross process bus lock, between mock handles:
+
+    $ python tests/test_buslock.py
+"""
+import os
+import signal
+import threading
+import time
+import unittest
+
+import spipy
+
+BUS, DEVICE = 8, 0
+
+
+class BusLockTest(unittest.TestCase):
+
+    def setUp(self):
+        signal.alarm(10)
+        self.holder = spipy.SPI(BUS, DEVICE, mock=True, lock=True)
+
+    def tearDown(self):
+        self.holder.close()
+        signal.alarm(0)
+
+    def waiter(self, prio, order):
+        spi = spipy.SPI(BUS, DEVICE, mock=True, lock=True)
+
+        def run():
+            spi.lock(prio)
+            order.append(prio)
+            spi.unlock()
+            spi.close()
+
+        t = threading.Thread(target=run)
+        t.daemon = True
+        t.start()
+        # let it register as a waiter before the next one comes
+        time.sleep(0.1)
+        return t
+
+    def test_higher_class_goes_first(self):
+        order = []
+        self.holder.lock()
+        threads = [self.waiter(spipy.PRIO_BULK, order),
+                   self.waiter(spipy.PRIO_NORMAL, order),
+                   self.waiter(spipy.PRIO_CRITICAL, order)]
+        self.holder.unlock()
+        for t in threads:
+            t.join(5)
+            self.assertFalse(t.is_alive())
+        self.assertEqual(order, [spipy.PRIO_CRITICAL, spipy.PRIO_NORMAL,
+                                 spipy.PRIO_BULK])
+
+    def test_lock_nests(self):
+        order = []
+        self.holder.lock()
+        self.holder.lock()
+        t = self.waiter(spipy.PRIO_CRITICAL, order)
+        self.holder.unlock()
+        time.sleep(0.1)
+        self.assertEqual(order, [])
+        self.holder.unlock()
+        t.join(5)
+        self.assertEqual(order, [spipy.PRIO_CRITICAL])
+
+    def test_unlock_without_lock(self):
+        self.assertRaises(spipy.error, self.holder.unlock)
+
+    def test_dead_holder_is_recovered(self):
+        pid = os.fork()
+        if pid == 0:
+            spi = spipy.SPI(BUS, DEVICE, mock=True, lock=True)
+            spi.lock()
+            os._exit(0)
+        os.waitpid(pid, 0)
+        self.holder.lock()
+        self.assertEqual(self.holder.transfer((1,)), (1,))
+        self.holder.unlock()
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,48 @@
+#!/usr/bin/env python
+"""calibrate() and its cache on the mock backend:
+
+    $ python tests/test_calibrate.py
+"""
+import os
+import shutil
+import tempfile
+import unittest
+
+import spipy
+
+
+class CalibrateCacheTest(unittest.TestCase):
+
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.cache = os.path.join(self.dir, "calibrate")
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def test_result_is_cached_per_backend(self):
+        spi = spipy.SPI(0, 0, mock=True)
+        first = spi.calibrate(nbytes=4096, sizes=(64, 256), depths=(1, 2),
+                cache=self.cache)
+        self.assertIn("results", first)
+        again = spi.calibrate(cache=self.cache)
+        self.assertNotIn("results", again)
+        self.assertEqual(again["segment"], first["segment"])
+        spi.close()
+
+        with open(self.cache) as f:
+            line = f.read().split()
+        self.assertEqual(line[:2], ["spidev0.0", "mock"])
+
+    def test_other_backend_is_not_reused(self):
+        with open(self.cache, "w") as f:
+            f.write("spidev0.0 device 1000000 4096 64 1\n")
+        spi = spipy.SPI(0, 0, mock=True)
+        found = spi.calibrate(nbytes=4096, sizes=(256,), depths=(2,),
+                cache=self.cache)
+        self.assertEqual((found["segment"], found["depth"]), (256, 2))
+        spi.close()
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,75 @@
+#!/usr/bin/env python
+"""Combining transfers from many threads into one message, on the mock
+backend:
+
+    $ python tests/test_combining.py
+"""
+import signal
+import threading
+import unittest
+
+import spipy
+
+THREADS, ROUNDS = 8, 50
+
+
+class CombiningTest(unittest.TestCase):
+
+    def setUp(self):
+        signal.alarm(20)
+
+    def tearDown(self):
+        signal.alarm(0)
+
+    def test_each_thread_gets_its_own_data(self):
+        spi = spipy.SPI(0, 0, mock=True)
+        # slow messages, so threads pile up behind the one sending
+        spi.set_faults(latency_usec=1000, latency_rate=1)
+        spi.set_combining(True)
+        wrong = []
+
+        def worker(n):
+            for i in range(ROUNDS):
+                values = (n, i, n ^ i)
+                if spi.transfer(values) != values:
+                    wrong.append(values)
+
+        threads = [threading.Thread(target=worker, args=(n,))
+                   for n in range(THREADS)]
+        for t in threads:
+            t.daemon = True
+            t.start()
+        for t in threads:
+            t.join(15)
+            self.assertFalse(t.is_alive())
+
+        self.assertEqual(wrong, [])
+        stats = spi.stats()
+        self.assertEqual(stats["segments"], THREADS * ROUNDS)
+        self.assertTrue(stats["transfers"] < THREADS * ROUNDS)
+        spi.close()
+
+    def test_error_reaches_every_thread(self):
+        spi = spipy.SPI(0, 0, mock=True)
+        spi.set_faults(error_rate=1, latency_usec=1000, latency_rate=1)
+        spi.set_combining(True)
+        errors = []
+
+        def worker():
+            try:
+                spi.transfer((1,))
+            except IOError as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=worker) for n in range(THREADS)]
+        for t in threads:
+            t.daemon = True
+            t.start()
+        for t in threads:
+            t.join(5)
+        self.assertEqual(len(errors), THREADS)
+        spi.close()
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,76 @@
+#!/usr/bin/env python
+"""Fault injection with set_faults() on the mock backend:
+
+    $ python tests/test_faults.py
+"""
+import errno
+import time
+import unittest
+
+import spipy
+
+
+class FaultsTest(unittest.TestCase):
+
+    def setUp(self):
+        self.spi = spipy.SPI(0, 0, mock=True)
+
+    def tearDown(self):
+        self.spi.close()
+
+    def run_errors(self, n):
+        failed = []
+        for i in range(n):
+            try:
+                self.spi.transfer((i & 0xff,))
+            except IOError as e:
+                failed.append((i, e.errno))
+        return failed
+
+    def test_errors(self):
+        self.spi.set_faults(seed=1, error_rate=1,
+                errnos=(errno.EIO, errno.ETIMEDOUT))
+        failed = self.run_errors(50)
+        self.assertEqual(len(failed), 50)
+        self.assertEqual(set(e for i, e in failed),
+                set([errno.EIO, errno.ETIMEDOUT]))
+        stats = self.spi.stats()
+        self.assertEqual((stats["injected_errors"], stats["errors"]), (50, 50))
+
+    def test_seed_repeats(self):
+        self.spi.set_faults(seed=7, error_rate=0.3, flip_rate=0.1)
+        first = self.run_errors(200)
+        self.spi.set_faults(seed=7, error_rate=0.3, flip_rate=0.1)
+        self.assertEqual(self.run_errors(200), first)
+        self.assertTrue(0 < len(first) < 200)
+
+    def test_flips(self):
+        self.spi.set_faults(seed=2, flip_rate=1)
+        got = self.spi.transfer((0,) * 8)
+        self.assertEqual(len([b for b in got if bin(b).count("1") == 1]), 8)
+        self.assertEqual(self.spi.stats()["injected_flips"], 8)
+
+    def test_busy_spell(self):
+        self.spi.set_faults(seed=1, busy_rate=1, busy_messages=3,
+                busy_mask=0x80)
+        self.assertEqual(self.spi.transfer((0, 0))[0] & 0x80, 0x80)
+        self.assertTrue(self.spi.stats()["injected_busy"] > 0)
+
+    def test_latency(self):
+        self.spi.set_faults(latency_usec=20000, latency_rate=1)
+        start = time.time()
+        self.spi.transfer((1,))
+        self.assertTrue(time.time() - start >= 0.02)
+        self.assertEqual(self.spi.stats()["injected_delays"], 1)
+
+    def test_off(self):
+        self.spi.set_faults(error_rate=1)
+        self.spi.set_faults()
+        self.assertEqual(self.spi.transfer((1, 2)), (1, 2))
+
+    def test_mock_only(self):
+        self.assertRaises(spipy.error, spipy.SPI().set_faults, error_rate=1)
+
+
+if __name__ == "__main__":
+    unittest.main()
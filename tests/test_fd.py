@@ -0,0 +1,97 @@
+#!/usr/bin/env python
+"""read_to_fd() and write_from_fd() on the mock backend, which sends
+back what it is given:
+
+    $ python tests/test_fd.py
+"""
+import os
+import tempfile
+import unittest
+
+import spipy
+
+
+class ReadToFdTest(unittest.TestCase):
+
+    def setUp(self):
+        self.spi = spipy.SPI(0, 0, mock=True)
+        self.file = tempfile.TemporaryFile()
+
+    def tearDown(self):
+        self.file.close()
+        self.spi.close()
+
+    def test_reads_in_chunks(self):
+        seen = []
+        self.assertEqual(self.spi.read_to_fd(self.file, 10000, cmd_prefix=(3,),
+                address=0, chunk=1000, progress=seen.append,
+                progress_every=4000), 10000)
+        self.assertEqual(seen, [4000, 8000, 10000])
+        self.file.seek(0)
+        # nothing is sent after the prefix, so the mock sends back zeros
+        self.assertEqual(self.file.read(), b"\0" * 10000)
+        # each chunk carries the command byte and a 3 byte address
+        stats = self.spi.stats()
+        self.assertEqual(stats["transfers"], 10)
+        self.assertEqual(stats["bytes"], 10000 + 10 * 4)
+
+    def test_offset_uses_pwrite(self):
+        self.spi.read_to_fd(self.file, 100, offset=2000)
+        self.assertEqual(os.fstat(self.file.fileno()).st_size, 2100)
+        self.assertEqual(self.file.tell(), 0)
+
+    def test_direct_rejects_unaligned_chunk(self):
+        self.assertRaises(ValueError, self.spi.read_to_fd, self.file, 4096,
+                chunk=1000, direct=True)
+        self.assertEqual(os.fstat(self.file.fileno()).st_size, 0)
+
+    def test_direct_rejects_unaligned_offset(self):
+        self.assertRaises(ValueError, self.spi.read_to_fd, self.file, 4096,
+                chunk=1024, offset=100, direct=True)
+
+
+class WriteFromFdTest(unittest.TestCase):
+
+    def setUp(self):
+        self.spi = spipy.SPI(0, 0, mock=True)
+
+    def tearDown(self):
+        self.spi.close()
+
+    def test_regular_file(self):
+        f = tempfile.TemporaryFile()
+        f.write(os.urandom(5000))
+        f.flush()
+        self.assertEqual(self.spi.write_from_fd(f), 5000)
+        self.assertEqual(self.spi.write_from_fd(f, offset=1000, length=100),
+                100)
+        self.assertEqual(self.spi.stats()["bytes"], 5100)
+        f.close()
+
+    def test_page_program(self):
+        f = tempfile.TemporaryFile()
+        f.write(os.urandom(1000))
+        f.flush()
+        self.spi.write_from_fd(f, cmd_prefix=(0x02,), address=0, chunk=256)
+        stats = self.spi.stats()
+        self.assertEqual(stats["transfers"], 4)
+        self.assertEqual(stats["bytes"], 1000 + 4 * 4)
+        f.close()
+
+    def test_pipe(self):
+        r, w = os.pipe()
+        os.write(w, b"x" * 300)
+        os.close(w)
+        self.assertEqual(self.spi.write_from_fd(r), 300)
+        os.close(r)
+
+    def test_pipe_refuses_offset(self):
+        r, w = os.pipe()
+        os.write(w, b"x" * 300)
+        os.close(w)
+        self.assertRaises(ValueError, self.spi.write_from_fd, r, offset=5)
+        os.close(r)
+
+
+if __name__ == "__main__":
+    unittest.main()
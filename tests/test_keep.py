@@ -0,0 +1,58 @@
+#!/usr/bin/env python
+"""keep= selectors for transfer() and start_sampler(), on the mock
+backend:
+
+    $ python tests/test_keep.py
+"""
+import time
+import unittest
+
+import spipy
+
+VALUES = (1, 2, 3, 4, 5)
+
+
+class KeepTest(unittest.TestCase):
+
+    def setUp(self):
+        self.spi = spipy.SPI(0, 0, mock=True)
+
+    def tearDown(self):
+        self.spi.close()
+
+    def test_slice(self):
+        self.assertEqual(self.spi.transfer(VALUES, keep=slice(1, 4)), (2, 3, 4))
+        self.assertEqual(self.spi.transfer(VALUES, keep=slice(None, None, 2)),
+                (1, 3, 5))
+
+    def test_offsets(self):
+        self.assertEqual(self.spi.transfer(VALUES, keep=[0, -1]), (1, 5))
+        self.assertEqual(self.spi.transfer(VALUES, keep=(4, 0)), (5, 1))
+
+    def test_bitmask(self):
+        self.assertEqual(self.spi.transfer(VALUES, keep=0b10101), (1, 3, 5))
+        self.assertEqual(self.spi.transfer(VALUES, keep=1 << 100), ())
+
+    def test_covers_rx_length(self):
+        self.assertEqual(self.spi.transfer((9,), rx_length=3, keep=[-1]), (0,))
+
+    def test_offset_out_of_range(self):
+        self.assertRaises(IndexError, self.spi.transfer, VALUES, keep=[5])
+
+    def test_bad_selector(self):
+        self.assertRaises(TypeError, self.spi.transfer, VALUES, keep=1.5)
+
+    def test_sampler(self):
+        name = self.spi.start_sampler((1, 2, 3, 4), 0.005, keep=[1, 3])
+        try:
+            deadline = time.time() + 5
+            while spipy.read_sample(name)["count"] == 0:
+                self.assertTrue(time.time() < deadline)
+                time.sleep(0.005)
+            self.assertEqual(spipy.read_sample(name)["data"], (2, 4))
+        finally:
+            self.spi.stop_sampler()
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,74 @@
+#!/usr/bin/env python
+"""The earliest deadline first scheduler behind schedule() and run(), on
+the mock backend:
+
+    $ python tests/test_sched.py
+"""
+import json
+import signal
+import unittest
+
+import spipy
+
+
+def sent_sizes():
+    """Sizes of the messages recorded since trace_start(), in order."""
+    events = json.loads(spipy.trace_export())["traceEvents"]
+    slices = sorted((e for e in events if e["ph"] == "X"),
+            key=lambda e: e["ts"])
+    return [e["args"]["bytes"] for e in slices]
+
+
+class SchedulerTest(unittest.TestCase):
+
+    def setUp(self):
+        signal.alarm(10)
+        self.spi = spipy.SPI(0, 0, mock=True)
+
+    def tearDown(self):
+        self.spi.close()
+        signal.alarm(0)
+
+    def test_one_shot_job(self):
+        job = self.spi.schedule((1, 2, 3), deadline=10000)
+        self.assertEqual(self.spi.result(job), None)
+        self.assertEqual(self.spi.run(0.1), 1)
+        self.assertEqual(self.spi.result(job), (1, 2, 3))
+        runs, misses, worst = self.spi.schedule_stats()[job]
+        self.assertEqual((runs, misses), (1, 0))
+
+    def test_periodic_job(self):
+        job = self.spi.schedule((7,), period=10000)
+        self.spi.run(0.1)
+        runs, misses, worst = self.spi.schedule_stats()[job]
+        self.assertTrue(8 <= runs <= 11, runs)
+        self.assertEqual(misses, 0)
+
+    def test_earliest_deadline_first(self):
+        late = self.spi.schedule((1,) * 3, deadline=50000)
+        soon = self.spi.schedule((2,) * 5, deadline=10000)
+        spipy.trace_start()
+        self.spi.run(0.1)
+        spipy.trace_stop()
+        self.assertEqual(sent_sizes(), [5, 3])
+        self.assertEqual(self.spi.result(late), (1,) * 3)
+        self.assertEqual(self.spi.result(soon), (2,) * 5)
+
+    def test_priority_breaks_ties(self):
+        self.spi.schedule((1,) * 3, deadline=10000, priority=spipy.PRIO_BULK)
+        self.spi.schedule((2,) * 5, deadline=10000,
+                priority=spipy.PRIO_CRITICAL)
+        spipy.trace_start()
+        self.spi.run(0.1)
+        spipy.trace_stop()
+        self.assertEqual(sent_sizes(), [5, 3])
+
+    def test_cancel(self):
+        job = self.spi.schedule((1,), period=10000)
+        self.spi.cancel(job)
+        self.assertEqual(self.spi.run(0.05), 0)
+        self.assertRaises(KeyError, self.spi.result, job)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,109 @@
+#!/usr/bin/env python
+"""The message trace and the shared memory stats and sample readers, on
+the mock backend:
+
+    $ python tests/test_trace_stats.py
+"""
+import errno
+import json
+import os
+import shutil
+import tempfile
+import time
+import unittest
+
+import spipy
+
+
+class TraceTest(unittest.TestCase):
+
+    def setUp(self):
+        self.spi = spipy.SPI(2, 1, mock=True)
+
+    def tearDown(self):
+        self.spi.close()
+
+    def slices(self, text):
+        return [e for e in json.loads(text)["traceEvents"] if e["ph"] == "X"]
+
+    def test_records_messages(self):
+        spipy.trace_start()
+        self.spi.transfer((1, 2, 3))
+        self.spi.write((4, 5))
+        spipy.trace_stop()
+        self.spi.transfer((6,))
+
+        events = self.slices(spipy.trace_export())
+        self.assertEqual([e["args"]["bytes"] for e in events], [3, 2])
+        self.assertEqual([e["args"]["result"] for e in events], [3, 2])
+        self.assertEqual(set((e["pid"], e["tid"]) for e in events),
+                set([(2, 1)]))
+
+    def test_failed_message(self):
+        self.spi.set_faults(error_rate=1, errnos=(errno.ETIMEDOUT,))
+        spipy.trace_start()
+        self.assertRaises(IOError, self.spi.transfer, (1,))
+        spipy.trace_stop()
+        events = self.slices(spipy.trace_export())
+        self.assertEqual(events[0]["args"]["result"], -errno.ETIMEDOUT)
+
+    def test_export_to_path(self):
+        tmp = tempfile.mkdtemp()
+        path = os.path.join(tmp, "trace.json")
+        try:
+            spipy.trace_start()
+            self.spi.transfer((1,))
+            spipy.trace_stop()
+            self.assertEqual(spipy.trace_export(path), None)
+            with open(path) as f:
+                self.assertEqual(len(self.slices(f.read())), 1)
+        finally:
+            shutil.rmtree(tmp)
+
+
+class StatsReaderTest(unittest.TestCase):
+
+    def setUp(self):
+        self.spi = spipy.SPI(2, 1, mock=True)
+
+    def tearDown(self):
+        self.spi.close()
+
+    def test_published_counters(self):
+        name = self.spi.publish_stats()
+        for i in range(5):
+            self.spi.transfer((1, 2))
+        stats = spipy.read_stats(name)
+        self.assertEqual((stats["pid"], stats["bus"], stats["device"]),
+                (os.getpid(), 2, 1))
+        self.assertEqual((stats["transfers"], stats["bytes"]), (5, 10))
+        self.assertEqual(sum(stats["latency"]), 5)
+
+    def test_one_publisher_per_name(self):
+        name = self.spi.publish_stats()
+        other = spipy.SPI(2, 1, mock=True)
+        self.assertRaises(spipy.error, other.publish_stats, name=name)
+        other.close()
+
+    def test_removed_on_close(self):
+        name = self.spi.publish_stats()
+        self.spi.publish_stats(False)
+        self.assertRaises(IOError, spipy.read_stats, name)
+
+    def test_sample(self):
+        name = self.spi.start_sampler((1, 2, 3), 0.005)
+        try:
+            deadline = time.time() + 5
+            while spipy.read_sample(name)["count"] < 2:
+                self.assertTrue(time.time() < deadline)
+                time.sleep(0.005)
+            sample = spipy.read_sample(name)
+            self.assertEqual((sample["data"], sample["error"]), ((1, 2, 3), 0))
+            self.assertTrue(abs(sample["time"] - time.time()) < 5)
+        finally:
+            self.spi.stop_sampler()
+        self.assertRaises(IOError, spipy.read_sample, name)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,46 @@
+#!/usr/bin/env python
+"""transfer_batch() on the mock backend, without numpy:
+
+    $ python tests/test_transfer_batch.py
+"""
+import unittest
+
+import spipy
+
+
+class TransferBatchTest(unittest.TestCase):
+
+    def setUp(self):
+        self.spi = spipy.SPI(0, 0, mock=True)
+
+    def tearDown(self):
+        self.spi.close()
+
+    def test_rows_come_back(self):
+        rows = bytearray(range(240))
+        out = self.spi.transfer_batch(rows, row_length=8)
+        self.assertEqual(out, rows)
+        self.assertEqual(self.spi.stats()["segments"], 30)
+
+    def test_into_out(self):
+        rows = bytearray(range(64))
+        out = bytearray(64)
+        self.assertTrue(self.spi.transfer_batch(rows, out=out, row_length=16)
+                is out)
+        self.assertEqual(out, rows)
+
+    def test_split_into_messages(self):
+        # more rows than one message can carry
+        rows = bytearray(100000)
+        self.spi.transfer_batch(rows, row_length=100)
+        stats = self.spi.stats()
+        self.assertEqual(stats["segments"], 1000)
+        self.assertTrue(stats["transfers"] > 1)
+
+    def test_ragged_rows(self):
+        self.assertRaises(ValueError, self.spi.transfer_batch,
+                bytearray(10), row_length=3)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,56 @@
+#!/usr/bin/env python
+"""transfer_verify() on the mock backend, which sends back what it is
+given unless set_faults() flips bits:
+
+    $ python tests/test_verify.py
+"""
+import os
+import unittest
+
+import spipy
+
+
+class TransferVerifyTest(unittest.TestCase):
+
+    def setUp(self):
+        self.spi = spipy.SPI(0, 0, mock=True)
+        self.data = bytearray(os.urandom(10000))
+
+    def tearDown(self):
+        self.spi.close()
+
+    def test_loopback_matches(self):
+        self.assertEqual(self.spi.transfer_verify(self.data, self.data), (0, ()))
+
+    def test_reports_first_offsets(self):
+        expected = bytearray(self.data)
+        for off in (3, 70, 4100, 9999):
+            expected[off] ^= 0x10
+        self.assertEqual(self.spi.transfer_verify(self.data, expected),
+                (4, (3, 70, 4100, 9999)))
+        self.assertEqual(
+                self.spi.transfer_verify(self.data, expected, max_report=2),
+                (4, (3, 70)))
+
+    def test_mask_hides_bits(self):
+        expected = bytearray(self.data)
+        expected[100] ^= 0x01
+        mask = bytearray(b"\xff" * len(self.data))
+        mask[100] = 0xfe
+        self.assertEqual(self.spi.transfer_verify(self.data, expected, mask),
+                (0, ()))
+
+    def test_flipped_bits_are_found(self):
+        self.spi.set_faults(seed=3, flip_rate=1)
+        mismatches, offsets = self.spi.transfer_verify(self.data, self.data,
+                max_report=4)
+        self.assertEqual(mismatches, len(self.data))
+        self.assertEqual(offsets, (0, 1, 2, 3))
+
+    def test_lengths_must_match(self):
+        self.assertRaises(ValueError, self.spi.transfer_verify, self.data,
+                self.data[1:])
+
+
+if __name__ == "__main__":
+    unittest.main()